@@ -0,0 +1,296 @@
+#include "kdtree.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+// Benchmarks construction and queries of the KD-Tree over a sweep of sizes, dimensions, point distributions and
+// build modes. Sizes go up to 1M points by default, --max_points=50000000 adds the larger ones. Use the
+// --benchmark_format=json or --benchmark_out=<file> options of Google Benchmark for machine-readable results.
+
+// Every point set lies in [-10, 10]^dim
+enum class Distribution
+{
+    Uniform,
+    // Gaussian clusters around 100 uniform centers
+    Clusters,
+    // Surface of the sphere of radius 10
+    Surface,
+    // Every point occurs about 100 times
+    Duplicates
+};
+
+const std::pair<Distribution, const char *> DISTRIBUTIONS[] = {{Distribution::Uniform, "uniform"},
+                                                               {Distribution::Clusters, "clusters"},
+                                                               {Distribution::Surface, "surface"},
+                                                               {Distribution::Duplicates, "duplicates"}};
+
+const std::size_t SIZES[] = {10'000UL, 100'000UL, 1'000'000UL, 10'000'000UL, 50'000'000UL};
+
+// Number of query points of a batched query
+const std::size_t BATCH_SIZE = 10'000UL;
+
+// Uniform points have this many neighbours within the search radius on average
+const double EXPECTED_RADIUS_NEIGHBOURS = 16.0;
+
+template <std::size_t dim>
+std::vector<point_t<double, dim>> generatePoints(Distribution distribution, std::size_t count, std::uint64_t seed)
+{
+    std::mt19937_64 gen(seed);
+    std::uniform_real_distribution<double> uniform(-10.0, 10.0);
+    std::normal_distribution<double> normal(0.0, 1.0);
+
+    auto uniformPoint = [&]() -> point_t<double, dim> {
+        point_t<double, dim> point;
+        for (auto &coordinate : point)
+        {
+            coordinate = uniform(gen);
+        }
+        return point;
+    };
+
+    std::vector<point_t<double, dim>> points;
+    points.reserve(count);
+    switch (distribution)
+    {
+    case Distribution::Uniform:
+        for (std::size_t i = 0UL; i < count; ++i)
+        {
+            points.push_back(uniformPoint());
+        }
+        break;
+    case Distribution::Clusters:
+    {
+        std::vector<point_t<double, dim>> centers;
+        for (std::size_t i = 0UL; i < 100UL; ++i)
+        {
+            centers.push_back(uniformPoint());
+        }
+        for (std::size_t i = 0UL; i < count; ++i)
+        {
+            point_t<double, dim> point = centers[gen() % centers.size()];
+            for (auto &coordinate : point)
+            {
+                coordinate = std::clamp(coordinate + 0.1 * normal(gen), -10.0, 10.0);
+            }
+            points.push_back(point);
+        }
+        break;
+    }
+    case Distribution::Surface:
+        for (std::size_t i = 0UL; i < count; ++i)
+        {
+            point_t<double, dim> point;
+            double norm = 0.0;
+            for (auto &coordinate : point)
+            {
+                coordinate = normal(gen);
+                norm += coordinate * coordinate;
+            }
+            norm = std::sqrt(norm);
+            for (auto &coordinate : point)
+            {
+                coordinate *= 10.0 / norm;
+            }
+            points.push_back(point);
+        }
+        break;
+    case Distribution::Duplicates:
+    {
+        std::vector<point_t<double, dim>> distinct;
+        for (std::size_t i = 0UL; i < std::max<std::size_t>(count / 100UL, 1UL); ++i)
+        {
+            distinct.push_back(uniformPoint());
+        }
+        for (std::size_t i = 0UL; i < count; ++i)
+        {
+            points.push_back(distinct[gen() % distinct.size()]);
+        }
+        break;
+    }
+    }
+    return points;
+}
+
+// Points, queries from the same distribution and the tree over the points. Only the last data set of every
+// dimension is kept, the benchmarks are registered such that those using the same data follow each other.
+template <std::size_t dim> struct DataSet
+{
+    Distribution distribution_;
+    std::size_t size_;
+    std::vector<point_t<double, dim>> points_;
+    std::vector<point_t<double, dim>> queries_;
+    std::unique_ptr<KDTree<double, dim>> tree_;
+};
+
+template <std::size_t dim> DataSet<dim> &dataSet(Distribution distribution, std::size_t size, bool with_tree)
+{
+    static DataSet<dim> data{Distribution::Uniform, 0UL, {}, {}, nullptr};
+    if (data.distribution_ != distribution || data.size_ != size)
+    {
+        data.tree_.reset();
+        data.points_ = generatePoints<dim>(distribution, size, 1UL);
+        data.queries_ = generatePoints<dim>(distribution, BATCH_SIZE, 2UL);
+        data.distribution_ = distribution;
+        data.size_ = size;
+    }
+    if (with_tree && !data.tree_)
+    {
+        data.tree_ = std::make_unique<KDTree<double, dim>>(data.points_, true);
+    }
+    return data;
+}
+
+// Radius of the ball holding EXPECTED_RADIUS_NEIGHBOURS of size uniform points in [-10, 10]^dim
+double searchRadius(std::size_t dim, std::size_t size)
+{
+    const double half = static_cast<double>(dim) / 2.0;
+    const double unit_ball = std::pow(std::acos(-1.0), half) / std::tgamma(half + 1.0);
+    const double volume = std::pow(20.0, static_cast<double>(dim)) * EXPECTED_RADIUS_NEIGHBOURS / size;
+    return std::pow(volume / unit_ball, 1.0 / static_cast<double>(dim));
+}
+
+template <std::size_t dim>
+void benchmarkBuild(benchmark::State &state, Distribution distribution, bool threaded)
+{
+    const std::size_t size = static_cast<std::size_t>(state.range(0));
+    const auto &points = dataSet<dim>(distribution, size, false).points_;
+
+    KDTreeBuildOptions options;
+    options.threaded = threaded;
+    for (auto _ : state)
+    {
+        KDTree<double, dim> kdtree(points, options);
+        benchmark::DoNotOptimize(kdtree);
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * size));
+}
+
+template <std::size_t dim> void benchmarkNearest(benchmark::State &state, Distribution distribution)
+{
+    const std::size_t size = static_cast<std::size_t>(state.range(0));
+    const auto &data = dataSet<dim>(distribution, size, true);
+
+    std::size_t i = 0UL;
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(data.tree_->nearestIndex(data.queries_[i]));
+        i = (i + 1UL) % data.queries_.size();
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations()));
+}
+
+template <std::size_t dim> void benchmarkRadius(benchmark::State &state, Distribution distribution)
+{
+    const std::size_t size = static_cast<std::size_t>(state.range(0));
+    const auto &data = dataSet<dim>(distribution, size, true);
+    const double radius = searchRadius(dim, size);
+
+    std::vector<std::pair<std::size_t, double>> neighbours;
+    std::size_t found = 0UL;
+    std::size_t i = 0UL;
+    for (auto _ : state)
+    {
+        data.tree_->findNeighborsWithinRadius(data.queries_[i], radius, neighbours, false);
+        found += neighbours.size();
+        i = (i + 1UL) % data.queries_.size();
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations()));
+    state.counters["neighbours"] = benchmark::Counter(static_cast<double>(found) / state.iterations());
+}
+
+template <std::size_t dim>
+void benchmarkBatch(benchmark::State &state, Distribution distribution, bool sort_queries)
+{
+    const std::size_t size = static_cast<std::size_t>(state.range(0));
+    const auto &data = dataSet<dim>(distribution, size, true);
+
+    KDTreeSearchOptions options;
+    options.sort_queries = sort_queries;
+    std::vector<std::size_t> indices;
+    for (auto _ : state)
+    {
+        data.tree_->nearest(data.queries_, indices, options);
+        benchmark::DoNotOptimize(indices.data());
+    }
+    state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * data.queries_.size()));
+}
+
+template <std::size_t dim> void registerBenchmarks(std::size_t max_points)
+{
+    const std::string suffix = "/" + std::to_string(dim) + "d";
+    for (const auto &[distribution, name] : DISTRIBUTIONS)
+    {
+        for (const std::size_t size : SIZES)
+        {
+            if (size > max_points)
+            {
+                continue;
+            }
+            const std::string prefix = std::string(name) + suffix;
+            const auto arg = static_cast<std::int64_t>(size);
+            const Distribution d = distribution;
+
+            benchmark::RegisterBenchmark(("Build/sequential/" + prefix).c_str(),
+                                         [d](benchmark::State &state) { benchmarkBuild<dim>(state, d, false); })
+                ->Arg(arg)
+                ->Unit(benchmark::kMillisecond);
+            benchmark::RegisterBenchmark(("Build/parallel/" + prefix).c_str(),
+                                         [d](benchmark::State &state) { benchmarkBuild<dim>(state, d, true); })
+                ->Arg(arg)
+                ->Unit(benchmark::kMillisecond);
+            benchmark::RegisterBenchmark(("Nearest/" + prefix).c_str(),
+                                         [d](benchmark::State &state) { benchmarkNearest<dim>(state, d); })
+                ->Arg(arg);
+            benchmark::RegisterBenchmark(("Radius/" + prefix).c_str(),
+                                         [d](benchmark::State &state) { benchmarkRadius<dim>(state, d); })
+                ->Arg(arg);
+            benchmark::RegisterBenchmark(("BatchNearest/" + prefix).c_str(),
+                                         [d](benchmark::State &state) { benchmarkBatch<dim>(state, d, false); })
+                ->Arg(arg)
+                ->Unit(benchmark::kMillisecond);
+            benchmark::RegisterBenchmark(("SortedBatchNearest/" + prefix).c_str(),
+                                         [d](benchmark::State &state) { benchmarkBatch<dim>(state, d, true); })
+                ->Arg(arg)
+                ->Unit(benchmark::kMillisecond);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::size_t max_points = 1'000'000UL;
+    const std::string max_points_flag = "--max_points=";
+    int remaining = 1;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (std::strncmp(argv[i], max_points_flag.c_str(), max_points_flag.size()) == 0)
+        {
+            max_points = std::stoul(argv[i] + max_points_flag.size());
+        }
+        else
+        {
+            argv[remaining++] = argv[i];
+        }
+    }
+    argc = remaining;
+
+    registerBenchmarks<2UL>(max_points);
+    registerBenchmarks<3UL>(max_points);
+    registerBenchmarks<8UL>(max_points);
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    {
+        return EXIT_FAILURE;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,245 @@
+#ifndef KDTREE_CLUSTERING_HPP_
+#define KDTREE_CLUSTERING_HPP_
+
+#include "kdtree.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <execution>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+// Label of the points that belong to no cluster
+const static std::size_t KDTREE_NOISE = std::numeric_limits<std::size_t>::max();
+
+struct EuclideanClusterOptions
+{
+    // Points within this distance of each other, inclusive, are neighbours, in the units of the metric of the tree
+    double radius = 1.0;
+
+    // Points with at least this many neighbours, themselves included, are core points as in DBSCAN. The
+    // default of 1 makes every point a core point, which is plain Euclidean cluster extraction.
+    std::size_t min_points = 1UL;
+
+    // Clusters with fewer or more points than these are reported as noise
+    std::size_t min_cluster_size = 1UL;
+    std::size_t max_cluster_size = std::numeric_limits<std::size_t>::max();
+};
+
+// Union-find over the slots of a tree that concurrent threads update without locks. Every root is the
+// smallest slot of its set, as unite links the larger root below the smaller one with a compare and swap,
+// which keeps the parents acyclic. find halves the paths it walks along.
+class KDTreeUnionFind
+{
+  public:
+    explicit KDTreeUnionFind(std::size_t size) : parents_(size)
+    {
+        for (std::size_t i = 0UL; i < size; ++i)
+        {
+            parents_[i].store(i, std::memory_order_relaxed);
+        }
+    }
+
+    std::size_t find(std::size_t element)
+    {
+        while (true)
+        {
+            std::size_t parent = parents_[element].load(std::memory_order_acquire);
+            if (parent == element)
+            {
+                return element;
+            }
+            const std::size_t grandparent = parents_[parent].load(std::memory_order_acquire);
+            if (grandparent != parent)
+            {
+                parents_[element].compare_exchange_weak(parent, grandparent, std::memory_order_release,
+                                                        std::memory_order_relaxed);
+            }
+            element = grandparent;
+        }
+    }
+
+    void unite(std::size_t lhs, std::size_t rhs)
+    {
+        while (true)
+        {
+            lhs = this->find(lhs);
+            rhs = this->find(rhs);
+            if (lhs == rhs)
+            {
+                return;
+            }
+            if (lhs < rhs)
+            {
+                std::swap(lhs, rhs);
+            }
+            // Fails if lhs stopped being a root in the meantime, then both are looked up again
+            std::size_t expected = lhs;
+            if (parents_[lhs].compare_exchange_strong(expected, rhs, std::memory_order_acq_rel))
+            {
+                return;
+            }
+        }
+    }
+
+  private:
+    std::vector<std::atomic<std::size_t>> parents_;
+};
+
+// Density based clustering of the points of a KDTree (DBSCAN), see euclideanClusters. Core points within
+// the radius of each other are united in parallel, each by one radius search over the slots of the tree that
+// feeds its neighbours straight into the union-find. Every other point joins the cluster of the first core
+// point found within the radius, or is noise. No neighbour lists are stored.
+template <typename Tree> class KDTreeClustering
+{
+  public:
+    using distance_t = typename Tree::distance_t;
+
+    static std::vector<std::size_t> labels(const Tree &tree, const EuclideanClusterOptions &options)
+    {
+        const std::size_t size = tree.size();
+        const distance_t radius = static_cast<distance_t>(tree.metric_.reduce(options.radius));
+        std::vector<std::size_t> slots(size);
+        std::iota(slots.begin(), slots.end(), 0UL);
+
+        // Searches stop counting once a point is known to be a core point
+        std::vector<std::uint8_t> core(size, 1U);
+        if (options.min_points > 1UL)
+        {
+            std::for_each(std::execution::par, slots.begin(), slots.end(), [&](const std::size_t &slot) -> void {
+                CountQuery query{radius, options.min_points, 0UL};
+                tree.searchTree(tree.storage_.point(slot), query);
+                core[slot] = (query.count_ >= options.min_points) ? 1U : 0U;
+            });
+        }
+
+        // Every pair of core points is united from the smaller slot
+        KDTreeUnionFind sets(size);
+        std::for_each(std::execution::par, slots.begin(), slots.end(), [&](const std::size_t &slot) -> void {
+            if (core[slot])
+            {
+                UniteQuery query{radius, slot, core, sets};
+                tree.searchTree(tree.storage_.point(slot), query);
+            }
+        });
+
+        // Border points join the set of a core neighbour, the sets of the core points are final by now
+        std::vector<std::size_t> roots(size);
+        std::for_each(std::execution::par, slots.begin(), slots.end(), [&](const std::size_t &slot) -> void {
+            if (core[slot])
+            {
+                roots[slot] = sets.find(slot);
+                return;
+            }
+            BorderQuery query{radius, core, size};
+            tree.searchTree(tree.storage_.point(slot), query);
+            roots[slot] = (query.core_slot_ < size) ? sets.find(query.core_slot_) : size;
+        });
+
+        std::vector<std::size_t> cluster_sizes(size + 1UL, 0UL);
+        for (const std::size_t root : roots)
+        {
+            ++cluster_sizes[root];
+        }
+
+        // Clusters are numbered in the order of their first point in the input
+        std::vector<std::size_t> root_labels(size, KDTREE_NOISE);
+        std::vector<std::size_t> slot_of_index(size);
+        for (std::size_t slot = 0UL; slot < size; ++slot)
+        {
+            slot_of_index[tree.storage_.index(slot)] = slot;
+        }
+        std::vector<std::size_t> labels(size, KDTREE_NOISE);
+        std::size_t cluster_count = 0UL;
+        for (std::size_t index = 0UL; index < size; ++index)
+        {
+            const std::size_t root = roots[slot_of_index[index]];
+            if (root == size || cluster_sizes[root] < options.min_cluster_size ||
+                cluster_sizes[root] > options.max_cluster_size)
+            {
+                continue;
+            }
+            if (root_labels[root] == KDTREE_NOISE)
+            {
+                root_labels[root] = cluster_count++;
+            }
+            labels[index] = root_labels[root];
+        }
+        return labels;
+    }
+
+  private:
+    struct CountQuery
+    {
+        distance_t radius_;
+        std::size_t min_points_;
+        std::size_t count_;
+
+        void visit(std::size_t, distance_t dist)
+        {
+            count_ += (dist <= radius_) ? 1UL : 0UL;
+        }
+
+        bool prune(distance_t distance) const
+        {
+            return distance > radius_ || count_ >= min_points_;
+        }
+    };
+
+    struct UniteQuery
+    {
+        distance_t radius_;
+        std::size_t slot_;
+        const std::vector<std::uint8_t> &core_;
+        KDTreeUnionFind &sets_;
+
+        void visit(std::size_t slot, distance_t dist)
+        {
+            if (slot > slot_ && dist <= radius_ && core_[slot])
+            {
+                sets_.unite(slot_, slot);
+            }
+        }
+
+        bool prune(distance_t distance) const
+        {
+            return distance > radius_;
+        }
+    };
+
+    struct BorderQuery
+    {
+        distance_t radius_;
+        const std::vector<std::uint8_t> &core_;
+        std::size_t core_slot_;
+
+        void visit(std::size_t slot, distance_t dist)
+        {
+            if (core_slot_ == core_.size() && dist <= radius_ && core_[slot])
+            {
+                core_slot_ = slot;
+            }
+        }
+
+        bool prune(distance_t distance) const
+        {
+            return distance > radius_ || core_slot_ != core_.size();
+        }
+    };
+};
+
+// Cluster label of every point of the tree in input order, numbered from 0 in the order in which the clusters
+// first occur in the input, or KDTREE_NOISE. Works for every layout and metric of KDTree.
+template <typename Tree>
+std::vector<std::size_t> euclideanClusters(const Tree &tree, const EuclideanClusterOptions &options)
+{
+    if (options.radius < 0.0)
+    {
+        throw std::invalid_argument("Radius must not be negative");
+    }
+    return KDTreeClustering<Tree>::labels(tree, options);
+}
+
+#endif // KDTREE_CLUSTERING_HPP_
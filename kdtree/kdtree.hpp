@@ -2,372 +2,3865 @@
 #define KDTREE_HPP_
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cmath>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <execution>
+#include <fstream>
 #include <future>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <numeric>
+#include <optional>
 #include <stdexcept>
+#include <string>
 #include <thread>
+#include <type_traits>
 #include <utility>
+#include <variant>
 #include <vector>
 
+// Parallel construction uses the work-stealing scheduler of TBB when it is available, and falls back to one
+// std::async thread per split otherwise. Define KDTREE_NO_TBB to force the fallback.
+#if !defined(KDTREE_NO_TBB) && __has_include(<tbb/parallel_invoke.h>)
+#define KDTREE_USE_TBB
+#include <tbb/parallel_invoke.h>
+#include <tbb/task_arena.h>
+#endif
+
+// Saved trees are opened by mapping the file into memory where mmap is available, and read into memory
+// otherwise
+#if __has_include(<sys/mman.h>)
+#define KDTREE_USE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 const static std::uint8_t DEFAULT_RECURSION_DEPTH =
     static_cast<std::uint8_t>(std::floor(std::log2(std::thread::hardware_concurrency())));
 
-template <typename T, std::size_t dim> using point_t = std::array<T, dim>;
-template <typename T, std::size_t dim> class KDTree
-{
-  protected:
-    using point_t = std::array<T, dim>;
+// Ranges of at most this many points are built sequentially by a single task
+const static std::size_t DEFAULT_GRAIN_SIZE = 16'384UL;
+
+// Ranges of at most this many points are not split any further, but stored as a leaf bucket
+const static std::size_t DEFAULT_LEAF_SIZE = 16UL;
+
+// The implicit tree is balanced, so no tree over std::size_t points has more levels than this
+const static std::size_t MAX_TREE_DEPTH = 64UL;
+
+// Leaf buckets are scanned in blocks of this many points, so that the distance buffer fits on the stack
+const static std::size_t LEAF_SCAN_BLOCK_SIZE = 64UL;
+
+// SplitRule::RandomizedVariance draws the splitting axis among this many axes with the largest variance
+const static std::size_t RANDOMIZED_SPLIT_AXES = 5UL;
+
+// Number of randomized trees of a KDForest
+const static std::size_t DEFAULT_FOREST_SIZE = 4UL;
+
+// Identifies the binary format written by KDTree::save, increased whenever the format changes
+const static std::array<char, 8> KDTREE_FILE_MAGIC = {'K', 'D', 'T', 'R', 'E', 'E', '\0', '\0'};
+const static std::uint32_t KDTREE_FILE_VERSION = 3U;
+
+// Every section of a saved tree starts at a multiple of this many bytes, which is a cache line
+const static std::size_t KDTREE_FILE_ALIGNMENT = 64UL;
+
+// Index reported by KDTree::correspondences for query points without a neighbour within the cutoff
+const static std::size_t KDTREE_NO_NEIGHBOUR = std::numeric_limits<std::size_t>::max();
+
+template <typename T, std::size_t dim> using point_t = std::array<T, dim>;
+
+// Type in which distances between points with coordinates of type T are computed and compared. Floating
+// point coordinates keep their own type, so that float trees run at the full SIMD width. Integer coordinates
+// of at most 16 bits are widened to 64 bits, where their distances are exact: a squared delta is below 2^34
+// and at most 256 of them are summed. 32 bit integers are widened to 128 bits where the compiler has them, for
+// the same reason with squared deltas below 2^66. Wider integers are compared as double, which rounds
+// distances of large coordinates. Specialize for other types.
+template <typename T, typename = void> struct KDTreeDistance
+{
+    using type = double;
+};
+template <typename T> struct KDTreeDistance<T, std::enable_if_t<std::is_floating_point_v<T>>>
+{
+    using type = T;
+};
+template <typename T> struct KDTreeDistance<T, std::enable_if_t<std::is_integral_v<T> && sizeof(T) <= 2UL>>
+{
+    using type = std::int64_t;
+};
+#ifdef __SIZEOF_INT128__
+template <typename T> struct KDTreeDistance<T, std::enable_if_t<std::is_integral_v<T> && sizeof(T) == 4UL>>
+{
+    __extension__ typedef __int128 type;
+};
+#endif
+
+// Rule that chooses the splitting axis of every internal node
+enum class SplitRule
+{
+    // Cycle through the axes with the depth of the node
+    Cycle,
+    // Axis with the largest extent of the points in the subtree
+    MaxSpread,
+    // Axis with the largest variance of the points in the subtree
+    MaxVariance,
+    // One of the RANDOMIZED_SPLIT_AXES axes with the largest variance, drawn from the seed of the build
+    RandomizedVariance
+};
+
+struct KDTreeBuildOptions
+{
+    // Build the tree using multiple threads
+    bool threaded = true;
+
+    // Maximum number of points stored contiguously in a leaf bucket
+    std::size_t leaf_size = DEFAULT_LEAF_SIZE;
+
+    // Rule that chooses the splitting axis of every internal node
+    SplitRule split_rule = SplitRule::Cycle;
+
+    // Number of threads used by a threaded build, 0 uses all hardware threads
+    std::size_t thread_count = 0UL;
+
+    // Ranges of at most this many points are built sequentially by a single task
+    std::size_t grain_size = DEFAULT_GRAIN_SIZE;
+
+    // Seed of SplitRule::RandomizedVariance, builds with the same seed give the same tree
+    std::uint64_t seed = 0UL;
+};
+
+struct KDTreeSearchOptions
+{
+    // Approximation factor: results are within (1 + epsilon) of the true nearest distance, 0 is exact
+    double epsilon = 0.0;
+
+    // Maximum number of leaf buckets scanned per query, 0 is unlimited
+    std::size_t max_leaves = 0UL;
+
+    // Process the queries of a batch in the order of the leaf buckets they fall into, so that consecutive
+    // queries share the paths through the tree. Results are still returned in the input order. Pays off for
+    // large batches over trees that do not fit into the cache.
+    bool sort_queries = false;
+};
+
+// Distance metrics, selected by the Metric parameter of KDTree. Distances are reported in a reduced form
+// that preserves their order, the squared distance for the Euclidean metrics, and computed in the
+// distance type D of the tree, see KDTreeDistance. A metric combines the
+// distances along the single axes with accumulate, starting from 0, and bounds the distance to every point
+// on the other side of a splitting plane and inside the interval of a bounding box along one axis from
+// below with splitDistance and intervalDistance, which decide what is pruned.
+struct EuclideanMetric
+{
+    template <typename D> D axisDistance(D delta, std::size_t) const
+    {
+        return delta * delta;
+    }
+
+    template <typename D> static D accumulate(D dist, D axis_distance)
+    {
+        return dist + axis_distance;
+    }
+
+    // Reduced form of a distance such as a search radius
+    double reduce(double distance) const
+    {
+        return distance * distance;
+    }
+
+    template <typename D> D splitDistance(D coordinate, D split, std::size_t axis) const
+    {
+        return this->axisDistance(split - coordinate, axis);
+    }
+
+    template <typename D> D intervalDistance(D coordinate, D low, D high, std::size_t axis) const
+    {
+        const D delta = (coordinate < low) ? low - coordinate : ((coordinate > high) ? coordinate - high : D(0));
+        return this->axisDistance(delta, axis);
+    }
+};
+
+// Sum of the absolute coordinate differences
+struct ManhattanMetric
+{
+    template <typename D> D axisDistance(D delta, std::size_t) const
+    {
+        // std::abs has no overload for the 128 bit distances of 32 bit integers
+        return (delta < D(0)) ? -delta : delta;
+    }
+
+    template <typename D> static D accumulate(D dist, D axis_distance)
+    {
+        return dist + axis_distance;
+    }
+
+    double reduce(double distance) const
+    {
+        return distance;
+    }
+
+    template <typename D> D splitDistance(D coordinate, D split, std::size_t axis) const
+    {
+        return this->axisDistance(split - coordinate, axis);
+    }
+
+    template <typename D> D intervalDistance(D coordinate, D low, D high, std::size_t axis) const
+    {
+        const D delta = (coordinate < low) ? low - coordinate : ((coordinate > high) ? coordinate - high : D(0));
+        return this->axisDistance(delta, axis);
+    }
+};
+
+// Largest absolute coordinate difference
+struct ChebyshevMetric
+{
+    template <typename D> D axisDistance(D delta, std::size_t) const
+    {
+        return (delta < D(0)) ? -delta : delta;
+    }
+
+    template <typename D> static D accumulate(D dist, D axis_distance)
+    {
+        return std::max(dist, axis_distance);
+    }
+
+    double reduce(double distance) const
+    {
+        return distance;
+    }
+
+    template <typename D> D splitDistance(D coordinate, D split, std::size_t axis) const
+    {
+        return this->axisDistance(split - coordinate, axis);
+    }
+
+    template <typename D> D intervalDistance(D coordinate, D low, D high, std::size_t axis) const
+    {
+        const D delta = (coordinate < low) ? low - coordinate : ((coordinate > high) ? coordinate - high : D(0));
+        return this->axisDistance(delta, axis);
+    }
+};
+
+// Euclidean distance after scaling every axis, without scaling a copy of the points
+template <std::size_t dim> class WeightedEuclideanMetric
+{
+  public:
+    explicit WeightedEuclideanMetric(const std::array<double, dim> &scales) : scales_(scales)
+    {
+    }
+
+    template <typename D> D axisDistance(D delta, std::size_t axis) const
+    {
+        static_assert(std::is_floating_point_v<D>, "Scaled distances need a floating point distance type");
+        const D scaled = delta * static_cast<D>(scales_[axis]);
+        return scaled * scaled;
+    }
+
+    template <typename D> static D accumulate(D dist, D axis_distance)
+    {
+        return dist + axis_distance;
+    }
+
+    double reduce(double distance) const
+    {
+        return distance * distance;
+    }
+
+    template <typename D> D splitDistance(D coordinate, D split, std::size_t axis) const
+    {
+        return this->axisDistance(split - coordinate, axis);
+    }
+
+    template <typename D> D intervalDistance(D coordinate, D low, D high, std::size_t axis) const
+    {
+        const D delta = (coordinate < low) ? low - coordinate : ((coordinate > high) ? coordinate - high : D(0));
+        return this->axisDistance(delta, axis);
+    }
+
+  private:
+    std::array<double, dim> scales_;
+};
+
+// Euclidean distance in a periodic box, where every axis wraps around after its box length. The points of
+// the tree must lie in [0, length) on every axis, query points may lie anywhere.
+template <std::size_t dim> class PeriodicEuclideanMetric
+{
+  public:
+    explicit PeriodicEuclideanMetric(const std::array<double, dim> &lengths) : lengths_(lengths)
+    {
+        for (const double length : lengths_)
+        {
+            if (!(length > 0.0))
+            {
+                throw std::invalid_argument("Box lengths must be positive");
+            }
+        }
+    }
+
+    template <typename D> D axisDistance(D delta, std::size_t axis) const
+    {
+        static_assert(std::is_floating_point_v<D>, "Wrapped distances need a floating point distance type");
+        const D length = static_cast<D>(lengths_[axis]);
+        const D distance = std::fmod(std::abs(delta), length);
+        const D wrapped = std::min(distance, length - distance);
+        return wrapped * wrapped;
+    }
+
+    template <typename D> static D accumulate(D dist, D axis_distance)
+    {
+        return dist + axis_distance;
+    }
+
+    double reduce(double distance) const
+    {
+        return distance * distance;
+    }
+
+    // The other side of the plane is [split, length) or [0, split], reached either directly or across
+    // the boundary of the box from the image of the coordinate in [0, length)
+    template <typename D> D splitDistance(D coordinate, D split, std::size_t axis) const
+    {
+        const D length = static_cast<D>(lengths_[axis]);
+        const D wrapped = coordinate - length * std::floor(coordinate / length);
+
+        D distance = 0;
+        if (coordinate < split)
+        {
+            distance = (wrapped < split) ? std::min(split - wrapped, wrapped) : D(0);
+        }
+        else
+        {
+            distance = (wrapped >= split) ? std::min(wrapped - split, length - wrapped) : D(0);
+        }
+        return distance * distance;
+    }
+
+    // The image of the coordinate in [low, low + length) lies either inside the interval or is closest to
+    // one of its ends, reached directly or across the boundary of the box
+    template <typename D> D intervalDistance(D coordinate, D low, D high, std::size_t axis) const
+    {
+        const D length = static_cast<D>(lengths_[axis]);
+        const D offset = coordinate - low;
+        const D wrapped = offset - length * std::floor(offset / length);
+
+        D distance = 0;
+        if (wrapped > high - low)
+        {
+            distance = std::min(wrapped - (high - low), length - wrapped);
+        }
+        return distance * distance;
+    }
+
+  private:
+    std::array<double, dim> lengths_;
+};
+
+// Results of a batched radius search in compressed sparse row form. The neighbours of query i are
+// indices[offsets[i]] to indices[offsets[i + 1]], with their distances at the same positions.
+struct KDTreeRadiusNeighbours
+{
+    std::vector<std::size_t> offsets;
+    std::vector<std::size_t> indices;
+    std::vector<double> distances;
+};
+
+// Work done by the queries of a tree built with instrumentation enabled. Nodes count the internal nodes
+// and leaf buckets entered, distance evaluations the points compared with the query, and pruned subtrees
+// those skipped because of their lower bound or after the query bound shrank below the bound of the
+// current one. Maximum stack depth is the largest number of subtrees waiting on the traversal stack.
+struct KDTreeQueryStats
+{
+    std::size_t queries = 0UL;
+    std::size_t nodes_visited = 0UL;
+    std::size_t leaves_scanned = 0UL;
+    std::size_t distance_evaluations = 0UL;
+    std::size_t subtrees_pruned = 0UL;
+    std::size_t max_stack_depth = 0UL;
+
+    KDTreeQueryStats &operator+=(const KDTreeQueryStats &other)
+    {
+        queries += other.queries;
+        nodes_visited += other.nodes_visited;
+        leaves_scanned += other.leaves_scanned;
+        distance_evaluations += other.distance_evaluations;
+        subtrees_pruned += other.subtrees_pruned;
+        max_stack_depth = std::max(max_stack_depth, other.max_stack_depth);
+        return *this;
+    }
+};
+
+// Counts the work of a single query. Without instrumentation all counting compiles to nothing.
+template <bool instrumented> class KDTreeQueryCounter
+{
+  public:
+    void visitNode()
+    {
+    }
+
+    void scanLeaf(std::size_t)
+    {
+    }
+
+    void evaluate()
+    {
+    }
+
+    void prune()
+    {
+    }
+
+    void stackDepth(std::size_t)
+    {
+    }
+};
+
+template <> class KDTreeQueryCounter<true>
+{
+  public:
+    KDTreeQueryCounter()
+    {
+        stats_.queries = 1UL;
+    }
+
+    void visitNode()
+    {
+        ++stats_.nodes_visited;
+    }
+
+    void scanLeaf(std::size_t points)
+    {
+        ++stats_.nodes_visited;
+        ++stats_.leaves_scanned;
+        stats_.distance_evaluations += points;
+    }
+
+    void evaluate()
+    {
+        ++stats_.distance_evaluations;
+    }
+
+    void prune()
+    {
+        ++stats_.subtrees_pruned;
+    }
+
+    void stackDepth(std::size_t depth)
+    {
+        stats_.max_stack_depth = std::max(stats_.max_stack_depth, depth);
+    }
+
+    const KDTreeQueryStats &stats() const
+    {
+        return stats_;
+    }
+
+  private:
+    KDTreeQueryStats stats_;
+};
+
+// Statistics summed up over all queries of a tree, which may run concurrently. Copies take a snapshot.
+class KDTreeTotalQueryStats
+{
+  public:
+    KDTreeTotalQueryStats() = default;
+
+    KDTreeTotalQueryStats(const KDTreeTotalQueryStats &other) noexcept
+    {
+        this->add(other.load());
+    }
+
+    KDTreeTotalQueryStats &operator=(const KDTreeTotalQueryStats &rhs) noexcept
+    {
+        if (this != &rhs)
+        {
+            const KDTreeQueryStats stats = rhs.load();
+            this->reset();
+            this->add(stats);
+        }
+        return *this;
+    }
+
+    void add(const KDTreeQueryStats &stats)
+    {
+        queries_.fetch_add(stats.queries, std::memory_order_relaxed);
+        nodes_visited_.fetch_add(stats.nodes_visited, std::memory_order_relaxed);
+        leaves_scanned_.fetch_add(stats.leaves_scanned, std::memory_order_relaxed);
+        distance_evaluations_.fetch_add(stats.distance_evaluations, std::memory_order_relaxed);
+        subtrees_pruned_.fetch_add(stats.subtrees_pruned, std::memory_order_relaxed);
+
+        std::size_t depth = max_stack_depth_.load(std::memory_order_relaxed);
+        while (depth < stats.max_stack_depth &&
+               !max_stack_depth_.compare_exchange_weak(depth, stats.max_stack_depth, std::memory_order_relaxed))
+        {
+        }
+    }
+
+    KDTreeQueryStats load() const
+    {
+        KDTreeQueryStats stats;
+        stats.queries = queries_.load(std::memory_order_relaxed);
+        stats.nodes_visited = nodes_visited_.load(std::memory_order_relaxed);
+        stats.leaves_scanned = leaves_scanned_.load(std::memory_order_relaxed);
+        stats.distance_evaluations = distance_evaluations_.load(std::memory_order_relaxed);
+        stats.subtrees_pruned = subtrees_pruned_.load(std::memory_order_relaxed);
+        stats.max_stack_depth = max_stack_depth_.load(std::memory_order_relaxed);
+        return stats;
+    }
+
+    void reset()
+    {
+        queries_.store(0UL, std::memory_order_relaxed);
+        nodes_visited_.store(0UL, std::memory_order_relaxed);
+        leaves_scanned_.store(0UL, std::memory_order_relaxed);
+        distance_evaluations_.store(0UL, std::memory_order_relaxed);
+        subtrees_pruned_.store(0UL, std::memory_order_relaxed);
+        max_stack_depth_.store(0UL, std::memory_order_relaxed);
+    }
+
+  private:
+    std::atomic<std::size_t> queries_{0UL};
+    std::atomic<std::size_t> nodes_visited_{0UL};
+    std::atomic<std::size_t> leaves_scanned_{0UL};
+    std::atomic<std::size_t> distance_evaluations_{0UL};
+    std::atomic<std::size_t> subtrees_pruned_{0UL};
+    std::atomic<std::size_t> max_stack_depth_{0UL};
+};
+
+// Placeholder for the statistics of a tree without instrumentation
+struct KDTreeNoQueryStats
+{
+};
+
+// Header of a saved tree. It is followed by the sections of the storage layout, the split axes and the
+// bounding boxes of the subtrees.
+struct KDTreeFileHeader
+{
+    std::array<char, 8> magic_;
+    std::uint32_t version_;
+    std::uint32_t dim_;
+    std::uint32_t coordinate_size_;
+    std::uint32_t index_size_;
+    std::uint32_t layout_;
+    std::uint32_t split_rule_;
+    std::uint64_t size_;
+    std::uint64_t leaf_size_;
+    std::uint64_t axes_size_;
+};
+
+// Contiguous read-only array that either owns its elements or points into a mapped file, which stays
+// mapped as long as any buffer refers to it
+template <typename U> class KDTreeBuffer
+{
+  public:
+    KDTreeBuffer() = default;
+
+    KDTreeBuffer(const KDTreeBuffer &other)
+        : owned_(other.owned_), mapping_(other.mapping_), data_(mapping_ ? other.data_ : owned_.data()),
+          size_(other.size_)
+    {
+    }
+
+    KDTreeBuffer(KDTreeBuffer &&other) noexcept
+        : owned_(std::move(other.owned_)), mapping_(std::move(other.mapping_)),
+          data_(std::exchange(other.data_, nullptr)), size_(std::exchange(other.size_, 0UL))
+    {
+    }
+
+    KDTreeBuffer &operator=(KDTreeBuffer other) noexcept
+    {
+        owned_.swap(other.owned_);
+        mapping_.swap(other.mapping_);
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        return *this;
+    }
+
+    void assign(std::vector<U> &&values)
+    {
+        owned_ = std::move(values);
+        mapping_.reset();
+        data_ = owned_.data();
+        size_ = owned_.size();
+    }
+
+    void map(const std::shared_ptr<const void> &mapping, const U *data, std::size_t size)
+    {
+        owned_.clear();
+        owned_.shrink_to_fit();
+        mapping_ = mapping;
+        data_ = data;
+        size_ = size;
+    }
+
+    const U *data() const
+    {
+        return data_;
+    }
+
+    std::size_t size() const
+    {
+        return size_;
+    }
+
+    bool empty() const
+    {
+        return size_ == 0UL;
+    }
+
+    const U &operator[](std::size_t i) const
+    {
+        return data_[i];
+    }
+
+  private:
+    std::vector<U> owned_;
+    std::shared_ptr<const void> mapping_;
+    const U *data_ = nullptr;
+    std::size_t size_ = 0UL;
+};
+
+// Storage layouts of the point coordinates, selected by the Layout parameter of KDTree
+struct ArrayOfStructs
+{
+};
+struct StructOfArrays
+{
+};
+struct StridedView
+{
+};
+
+// Holds the point coordinates in tree order together with the input index of every slot, and computes
+// distances from a query point to them
+template <typename T, std::size_t dim, typename Layout> class KDTreeStorage;
+
+// One std::array<T, dim> per point, so all coordinates of a point share a cache line
+template <typename T, std::size_t dim> class KDTreeStorage<T, dim, ArrayOfStructs>
+{
+  public:
+    using point_t = std::array<T, dim>;
+    using distance_t = typename KDTreeDistance<T>::type;
+
+    // Saved trees hold the points followed by the indices
+    static const std::uint32_t LAYOUT_ID = 0U;
+    static const std::size_t SECTION_COUNT = 2UL;
+
+    void assign(std::vector<point_t> &&points, std::vector<std::size_t> &&indices)
+    {
+        points_.assign(std::move(points));
+        indices_.assign(std::move(indices));
+    }
+
+    static std::array<std::size_t, SECTION_COUNT> sectionSizes(std::size_t count)
+    {
+        return {count * sizeof(point_t), count * sizeof(std::size_t)};
+    }
+
+    std::array<const void *, SECTION_COUNT> sectionData() const
+    {
+        return {points_.data(), indices_.data()};
+    }
+
+    void map(const std::shared_ptr<const void> &mapping,
+             const std::array<const unsigned char *, SECTION_COUNT> &sections, std::size_t count)
+    {
+        points_.map(mapping, reinterpret_cast<const point_t *>(sections[0]), count);
+        indices_.map(mapping, reinterpret_cast<const std::size_t *>(sections[1]), count);
+    }
+
+    std::size_t size() const
+    {
+        return points_.size();
+    }
+
+    bool empty() const
+    {
+        return points_.empty();
+    }
+
+    std::size_t index(std::size_t slot) const
+    {
+        return indices_[slot];
+    }
+
+    T coordinate(std::size_t slot, std::size_t axis) const
+    {
+        return points_[slot][axis];
+    }
+
+    point_t point(std::size_t slot) const
+    {
+        return points_[slot];
+    }
+
+    template <typename Metric>
+    distance_t distance(std::size_t slot, const point_t &point, const Metric &metric) const
+    {
+        const point_t &node = points_[slot];
+        distance_t dist = 0;
+        for (std::size_t i = 0; i < dim; ++i)
+        {
+            const distance_t delta = static_cast<distance_t>(node[i]) - static_cast<distance_t>(point[i]);
+            dist = metric.accumulate(dist, metric.axisDistance(delta, i));
+        }
+        return dist;
+    }
+
+    // Distances from the point to every point of the range [begin, end). Looping over the axes in the
+    // outer loop leaves the inner loop free of dependencies, so that it is vectorized by the compiler.
+    template <typename Metric>
+    void distances(std::size_t begin, std::size_t end, const point_t &point, const Metric &metric,
+                   distance_t *distances) const
+    {
+        const point_t *leaf = points_.data() + begin;
+        const std::size_t count = end - begin;
+
+        std::fill(distances, distances + count, distance_t(0));
+        for (std::size_t axis = 0; axis < dim; ++axis)
+        {
+            const distance_t coordinate = static_cast<distance_t>(point[axis]);
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                const distance_t delta = static_cast<distance_t>(leaf[i][axis]) - coordinate;
+                distances[i] = metric.accumulate(distances[i], metric.axisDistance(delta, axis));
+            }
+        }
+    }
+
+  private:
+    KDTreeBuffer<point_t> points_;
+    KDTreeBuffer<std::size_t> indices_;
+};
+
+// One contiguous array per axis, so that the leaf scan streams unit-stride loads over several points
+// at once and vectorizes to the full SIMD width
+template <typename T, std::size_t dim> class KDTreeStorage<T, dim, StructOfArrays>
+{
+  public:
+    using point_t = std::array<T, dim>;
+    using distance_t = typename KDTreeDistance<T>::type;
+
+    // Saved trees hold one section per axis followed by the indices
+    static const std::uint32_t LAYOUT_ID = 1U;
+    static const std::size_t SECTION_COUNT = dim + 1UL;
+
+    void assign(std::vector<point_t> &&points, std::vector<std::size_t> &&indices)
+    {
+        indices_.assign(std::move(indices));
+        size_ = points.size();
+        for (std::size_t axis = 0; axis < dim; ++axis)
+        {
+            std::vector<T> coordinates(size_);
+            for (std::size_t i = 0; i < size_; ++i)
+            {
+                coordinates[i] = points[i][axis];
+            }
+            coordinates_[axis].assign(std::move(coordinates));
+        }
+        points.clear();
+        points.shrink_to_fit();
+    }
+
+    static std::array<std::size_t, SECTION_COUNT> sectionSizes(std::size_t count)
+    {
+        std::array<std::size_t, SECTION_COUNT> sizes;
+        sizes.fill(count * sizeof(T));
+        sizes.back() = count * sizeof(std::size_t);
+        return sizes;
+    }
+
+    std::array<const void *, SECTION_COUNT> sectionData() const
+    {
+        std::array<const void *, SECTION_COUNT> data;
+        for (std::size_t axis = 0; axis < dim; ++axis)
+        {
+            data[axis] = coordinates_[axis].data();
+        }
+        data.back() = indices_.data();
+        return data;
+    }
+
+    void map(const std::shared_ptr<const void> &mapping,
+             const std::array<const unsigned char *, SECTION_COUNT> &sections, std::size_t count)
+    {
+        size_ = count;
+        for (std::size_t axis = 0; axis < dim; ++axis)
+        {
+            coordinates_[axis].map(mapping, reinterpret_cast<const T *>(sections[axis]), count);
+        }
+        indices_.map(mapping, reinterpret_cast<const std::size_t *>(sections.back()), count);
+    }
+
+    std::size_t size() const
+    {
+        return size_;
+    }
+
+    bool empty() const
+    {
+        return size_ == 0UL;
+    }
+
+    std::size_t index(std::size_t slot) const
+    {
+        return indices_[slot];
+    }
+
+    T coordinate(std::size_t slot, std::size_t axis) const
+    {
+        return coordinates_[axis][slot];
+    }
+
+    point_t point(std::size_t slot) const
+    {
+        point_t point;
+        for (std::size_t axis = 0; axis < dim; ++axis)
+        {
+            point[axis] = coordinates_[axis][slot];
+        }
+        return point;
+    }
+
+    template <typename Metric>
+    distance_t distance(std::size_t slot, const point_t &point, const Metric &metric) const
+    {
+        distance_t dist = 0;
+        for (std::size_t i = 0; i < dim; ++i)
+        {
+            const distance_t delta =
+                static_cast<distance_t>(coordinates_[i][slot]) - static_cast<distance_t>(point[i]);
+            dist = metric.accumulate(dist, metric.axisDistance(delta, i));
+        }
+        return dist;
+    }
+
+    template <typename Metric>
+    void distances(std::size_t begin, std::size_t end, const point_t &point, const Metric &metric,
+                   distance_t *distances) const
+    {
+        const std::size_t count = end - begin;
+
+        std::fill(distances, distances + count, distance_t(0));
+        for (std::size_t axis = 0; axis < dim; ++axis)
+        {
+            const T *leaf = coordinates_[axis].data() + begin;
+            const distance_t coordinate = static_cast<distance_t>(point[axis]);
+            for (std::size_t i = 0; i < count; ++i)
+            {
+                const distance_t delta = static_cast<distance_t>(leaf[i]) - coordinate;
+                distances[i] = metric.accumulate(distances[i], metric.axisDistance(delta, axis));
+            }
+        }
+    }
+
+  private:
+    std::array<KDTreeBuffer<T>, dim> coordinates_;
+    KDTreeBuffer<std::size_t> indices_;
+    std::size_t size_ = 0UL;
+};
+
+// Coordinates stay in a buffer owned by the caller, point i starting at data[i * stride]. Only the
+// permutation of the input indices into tree order is stored, and every access goes through it.
+template <typename T, std::size_t dim> class KDTreeStorage<T, dim, StridedView>
+{
+  public:
+    using point_t = std::array<T, dim>;
+    using distance_t = typename KDTreeDistance<T>::type;
+
+    void bind(const T *data, std::size_t stride)
+    {
+        data_ = data;
+        stride_ = stride;
+    }
+
+    void assign(std::vector<std::size_t> &&indices)
+    {
+        indices_ = std::move(indices);
+    }
+
+    // Coordinate of a point by its index in the input, which is all the build needs to partition
+    T inputCoordinate(std::size_t index, std::size_t axis) const
+    {
+        return data_[index * stride_ + axis];
+    }
+
+    std::size_t size() const
+    {
+        return indices_.size();
+    }
+
+    bool empty() const
+    {
+        return indices_.empty();
+    }
+
+    std::size_t index(std::size_t slot) const
+    {
+        return indices_[slot];
+    }
+
+    T coordinate(std::size_t slot, std::size_t axis) const
+    {
+        return data_[indices_[slot] * stride_ + axis];
+    }
+
+    point_t point(std::size_t slot) const
+    {
+        const T *coordinates = data_ + indices_[slot] * stride_;
+        point_t point;
+        std::copy(coordinates, coordinates + dim, point.begin());
+        return point;
+    }
+
+    template <typename Metric>
+    distance_t distance(std::size_t slot, const point_t &point, const Metric &metric) const
+    {
+        const T *coordinates = data_ + indices_[slot] * stride_;
+        distance_t dist = 0;
+        for (std::size_t i = 0; i < dim; ++i)
+        {
+            const distance_t delta = static_cast<distance_t>(coordinates[i]) - static_cast<distance_t>(point[i]);
+            dist = metric.accumulate(dist, metric.axisDistance(delta, i));
+        }
+        return dist;
+    }
+
+    template <typename Metric>
+    void distances(std::size_t begin, std::size_t end, const point_t &point, const Metric &metric,
+                   distance_t *distances) const
+    {
+        for (std::size_t i = begin; i < end; ++i)
+        {
+            distances[i - begin] = this->distance(i, point, metric);
+        }
+    }
+
+  private:
+    const T *data_ = nullptr;
+    std::size_t stride_ = dim;
+    std::vector<std::size_t> indices_;
+};
+
+// Balanced KD-Tree with an implicit node layout: the median of every range [begin, end) is stored at
+// slot middle, its left subtree occupies [begin, middle) and its right subtree (middle, end).
+// Children are found by index arithmetic, so the storage holds nothing but coordinates and the tree
+// can be freely copied and moved. The coordinates are stored either as an array of structs or as a
+// struct of arrays, see KDTreeStorage. Ranges with at most leaf_size points are leaf buckets, which are
+// scanned brute-force instead of being split down to single points. The splitting axis of every internal
+// node is chosen by a SplitRule and stored per node. Every slot remembers the index of
+// its point in the input, so that queries can return indices instead of copies of the coordinates.
+// With the StridedView layout the tree is built over a buffer owned by the caller without copying it.
+// Distances are measured by the Metric, see EuclideanMetric.
+// Trees can be saved to a file and opened again by mapping it into memory, see save and open.
+template <typename T, std::size_t dim, typename Layout = ArrayOfStructs, typename Metric = EuclideanMetric,
+          bool instrumented = false>
+class KDTree
+{
+    static_assert(dim > 0UL && dim <= 256UL, "Split axes are stored in a single byte per node");
+
+    // Runs its own queries over the slots of its subtrees
+    template <typename, std::size_t, typename, typename> friend class DynamicKDTree;
+    template <typename, std::size_t, typename> friend class KDForest;
+    template <typename> friend class KDTreeClustering;
+
+  protected:
+    using point_t = std::array<T, dim>;
+
+  public:
+    // Type in which distances are computed, results are reported as double
+    using distance_t = typename KDTreeDistance<T>::type;
+
+    // Index of a point in the input together with its distance to the query point, in the reduced form of
+    // the metric
+    using neighbour_t = std::pair<std::size_t, double>;
+
+    // Axis-aligned box given by its lowest and highest corner
+    using box_t = std::pair<point_t, point_t>;
+
+    KDTree(const KDTree &other) = default;
+    KDTree(KDTree &&other) noexcept = default;
+    KDTree &operator=(const KDTree &rhs) = default;
+    KDTree &operator=(KDTree &&rhs) noexcept = default;
+
+    explicit KDTree(const typename std::vector<point_t>::iterator &begin,
+                    const typename std::vector<point_t>::iterator &end, bool threaded = true)
+        : KDTree(begin, end, defaultOptions(threaded))
+    {
+    }
+
+    explicit KDTree(const typename std::vector<point_t>::iterator &begin,
+                    const typename std::vector<point_t>::iterator &end, const KDTreeBuildOptions &options,
+                    const Metric &metric = Metric())
+        : metric_(metric), leaf_size_(options.leaf_size), split_rule_(options.split_rule),
+          seed_(options.seed)
+    {
+        this->build(makeBuildEntries(begin, end), options);
+    }
+
+    explicit KDTree(const std::vector<point_t> &points, bool threaded = true)
+        : KDTree(points, defaultOptions(threaded))
+    {
+    }
+
+    explicit KDTree(const std::vector<point_t> &points, const KDTreeBuildOptions &options,
+                    const Metric &metric = Metric())
+        : metric_(metric), leaf_size_(options.leaf_size), split_rule_(options.split_rule),
+          seed_(options.seed)
+    {
+        this->build(makeBuildEntries(points.begin(), points.end()), options);
+    }
+
+    // Builds a StridedView tree over count points of a caller owned buffer, the coordinates of point i
+    // starting at data[i * stride]. The buffer is not copied, it must outlive the tree and stay unchanged.
+    explicit KDTree(const T *data, std::size_t count, std::size_t stride = dim, bool threaded = true)
+        : KDTree(data, count, stride, defaultOptions(threaded))
+    {
+    }
+
+    explicit KDTree(const T *data, std::size_t count, std::size_t stride, const KDTreeBuildOptions &options,
+                    const Metric &metric = Metric())
+        : metric_(metric), leaf_size_(options.leaf_size), split_rule_(options.split_rule),
+          seed_(options.seed)
+    {
+        static_assert(std::is_same_v<Layout, StridedView>, "Only a StridedView tree refers to a caller buffer");
+        if (stride < dim)
+        {
+            throw std::invalid_argument("Stride must not be smaller than the number of dimensions");
+        }
+
+        storage_.bind(data, stride);
+
+        std::vector<std::size_t> nodes(count);
+        std::iota(nodes.begin(), nodes.end(), 0UL);
+        this->build(std::move(nodes), options);
+    }
+
+    std::size_t size() const
+    {
+        return storage_.size();
+    }
+
+    point_t nearest(const point_t &point) const
+    {
+        return this->nearest(point, KDTreeSearchOptions());
+    }
+
+    point_t nearest(const point_t &point, const KDTreeSearchOptions &options) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+
+        std::size_t best = storage_.size();
+        distance_t best_dist = std::numeric_limits<distance_t>::max();
+        this->nearestSearch(point, best, best_dist, options);
+
+        return storage_.point(best);
+    }
+
+    void nearest(const std::vector<point_t> &points, std::vector<point_t> &neighbours,
+                 const KDTreeSearchOptions &options = KDTreeSearchOptions()) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+        const auto &number_of_points = points.size();
+
+        neighbours.clear();
+        neighbours.resize(number_of_points);
+
+        const std::vector<std::size_t> indices = this->queryOrder(points, options);
+
+        std::for_each(std::execution::par, indices.begin(), indices.end(), [&](const std::size_t &i) -> void {
+            std::size_t best = storage_.size();
+            distance_t best_dist = std::numeric_limits<distance_t>::max();
+
+            this->nearestSearch(points[i], best, best_dist, options);
+
+            neighbours[i] = storage_.point(best);
+        });
+    }
+
+    std::size_t nearestIndex(const point_t &point) const
+    {
+        return this->nearestIndex(point, KDTreeSearchOptions());
+    }
+
+    std::size_t nearestIndex(const point_t &point, const KDTreeSearchOptions &options) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+
+        std::size_t best = storage_.size();
+        distance_t best_dist = std::numeric_limits<distance_t>::max();
+        this->nearestSearch(point, best, best_dist, options);
+
+        return storage_.index(best);
+    }
+
+    // Nearest neighbour of a query point that is close to the point hint of the tree, such as a tracked point
+    // that matched hint in the previous frame and moved little since. The distance to the hint is the initial
+    // bound of the search, which then prunes most of the tree right away. The result is exact for any hint,
+    // a hint that is not a point of the tree at worst costs a second, unbounded search.
+    std::size_t nearestIndex(const point_t &point, const point_t &hint) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+
+        return this->hintedNearestIndex(point, this->inclusiveBound(this->pointDistance(point, hint)));
+    }
+
+    // Same with the hint given as a distance in the units of the metric, such as the distance of the match in
+    // the previous frame plus the largest expected motion. The result is exact for any hint, a hint below the
+    // distance of the nearest neighbour at worst costs a second, unbounded search.
+    std::size_t nearestIndex(const point_t &point, double hint_distance) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+
+        return this->hintedNearestIndex(point, this->inclusiveBound(metric_.reduce(hint_distance)));
+    }
+
+    // Matches every query point with its nearest neighbour within max_distance, for example the points of
+    // two consecutive frames. indices holds the index of the match in the input and distances its distance
+    // in the reduced form of the metric. Query points without a point within max_distance get
+    // KDTREE_NO_NEIGHBOUR and an infinite distance. The cutoff is the initial bound of every search, so far
+    // matches are rejected without descending into the tree.
+    void correspondences(const std::vector<point_t> &points, double max_distance, std::vector<std::size_t> &indices,
+                         std::vector<double> &distances,
+                         const KDTreeSearchOptions &options = KDTreeSearchOptions()) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+        const auto &number_of_points = points.size();
+        const distance_t cutoff = this->inclusiveBound(metric_.reduce(max_distance));
+
+        indices.clear();
+        distances.clear();
+        indices.resize(number_of_points);
+        distances.resize(number_of_points);
+
+        const std::vector<std::size_t> order = this->queryOrder(points, options);
+
+        std::for_each(std::execution::par, order.begin(), order.end(), [&](const std::size_t &i) -> void {
+            std::size_t best = storage_.size();
+            distance_t best_dist = cutoff;
+
+            this->nearestSearch(points[i], best, best_dist, options);
+
+            const bool found = best < storage_.size();
+            indices[i] = found ? storage_.index(best) : KDTREE_NO_NEIGHBOUR;
+            distances[i] = found ? static_cast<double>(best_dist) : std::numeric_limits<double>::infinity();
+        });
+    }
+
+    void nearest(const std::vector<point_t> &points, std::vector<std::size_t> &neighbour_indices,
+                 const KDTreeSearchOptions &options = KDTreeSearchOptions()) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+        const auto &number_of_points = points.size();
+
+        neighbour_indices.clear();
+        neighbour_indices.resize(number_of_points);
+
+        const std::vector<std::size_t> indices = this->queryOrder(points, options);
+
+        std::for_each(std::execution::par, indices.begin(), indices.end(), [&](const std::size_t &i) -> void {
+            std::size_t best = storage_.size();
+            distance_t best_dist = std::numeric_limits<distance_t>::max();
+
+            this->nearestSearch(points[i], best, best_dist, options);
+
+            neighbour_indices[i] = storage_.index(best);
+        });
+    }
+
+    std::vector<point_t> knearest(const point_t &point, std::size_t k) const
+    {
+        std::vector<point_t> neighbours;
+        std::vector<double> distances;
+        this->knearest(point, k, neighbours, distances);
+        return neighbours;
+    }
+
+    void knearest(const point_t &point, std::size_t k, std::vector<point_t> &neighbours,
+                  std::vector<double> &distances) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+
+        std::vector<std::pair<distance_t, std::size_t>> heap;
+        heap.reserve(k + 1);
+        this->knearestSearch(point, k, heap, KDTreeSearchOptions());
+
+        heapToSortedNeighbours(heap, neighbours, distances);
+    }
+
+    void knearest(const std::vector<point_t> &points, std::size_t k, std::vector<std::vector<point_t>> &neighbours,
+                  std::vector<std::vector<double>> &distances) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+        const auto &number_of_points = points.size();
+
+        neighbours.clear();
+        distances.clear();
+
+        neighbours.resize(number_of_points);
+        distances.resize(number_of_points);
+
+        std::vector<std::size_t> indices;
+        indices.resize(number_of_points);
+        std::iota(indices.begin(), indices.end(), 0UL);
+
+        std::for_each(std::execution::par, indices.begin(), indices.end(), [&](const std::size_t &i) -> void {
+            std::vector<std::pair<distance_t, std::size_t>> heap;
+            heap.reserve(k + 1);
+            this->knearestSearch(points[i], k, heap, KDTreeSearchOptions());
+
+            heapToSortedNeighbours(heap, neighbours[i], distances[i]);
+        });
+    }
+
+    void knearest(const point_t &point, std::size_t k, std::vector<neighbour_t> &neighbours) const
+    {
+        this->knearest(point, k, neighbours, KDTreeSearchOptions());
+    }
+
+    void knearest(const point_t &point, std::size_t k, std::vector<neighbour_t> &neighbours,
+                  const KDTreeSearchOptions &options) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+
+        std::vector<std::pair<distance_t, std::size_t>> heap;
+        heap.reserve(k + 1);
+        this->knearestSearch(point, k, heap, options);
+
+        heapToSortedNeighbours(heap, neighbours);
+    }
+
+    void knearest(const std::vector<point_t> &points, std::size_t k, std::vector<std::vector<neighbour_t>> &neighbours,
+                  const KDTreeSearchOptions &options = KDTreeSearchOptions()) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+        const auto &number_of_points = points.size();
+
+        neighbours.clear();
+        neighbours.resize(number_of_points);
+
+        const std::vector<std::size_t> indices = this->queryOrder(points, options);
+
+        std::for_each(std::execution::par, indices.begin(), indices.end(), [&](const std::size_t &i) -> void {
+            std::vector<std::pair<distance_t, std::size_t>> heap;
+            heap.reserve(k + 1);
+            this->knearestSearch(points[i], k, heap, options);
+
+            heapToSortedNeighbours(heap, neighbours[i]);
+        });
+    }
+
+    // k nearest neighbours of every point of the tree among the other points, by the index of the point in
+    // the input. A point is not its own neighbour, but duplicates of it are. The tree is joined with itself
+    // by a dual-tree traversal, which skips pairs of subtrees whose bounding boxes are farther apart than
+    // the k-th neighbour found so far of any point in the query subtree. Disjoint query subtrees are joined
+    // in parallel.
+    void allNearestNeighbours(std::size_t k, std::vector<std::vector<neighbour_t>> &neighbours) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+        const std::size_t number_of_points = storage_.size();
+
+        SelfJoin join{k, std::vector<std::vector<std::pair<distance_t, std::size_t>>>(number_of_points),
+                      std::vector<distance_t>(boxCount(axes_.size()), std::numeric_limits<distance_t>::max())};
+        if (k > 0UL)
+        {
+            // About 16 query subtrees per thread, the medians above them are joined as single points
+            const std::size_t thread_count = std::max<std::size_t>(std::thread::hardware_concurrency(), 1UL);
+            const std::size_t depth = static_cast<std::size_t>(std::floor(std::log2(thread_count))) + 4UL;
+
+            const RangeEntry root{0UL, number_of_points, 0UL};
+            std::vector<RangeEntry> subtrees{root};
+            std::vector<std::size_t> medians;
+            for (std::size_t level = 0UL; level < depth; ++level)
+            {
+                std::vector<RangeEntry> children;
+                for (const RangeEntry &subtree : subtrees)
+                {
+                    if (this->isLeaf(subtree.begin_, subtree.end_))
+                    {
+                        children.push_back(subtree);
+                        continue;
+                    }
+                    const std::size_t middle = subtree.begin_ + (subtree.end_ - subtree.begin_) / 2;
+                    medians.push_back(middle);
+                    children.push_back(RangeEntry{subtree.begin_, middle, leftChild(subtree.node_)});
+                    if (subtree.end_ > middle + 1UL)
+                    {
+                        children.push_back(RangeEntry{middle + 1UL, subtree.end_, rightChild(subtree.node_)});
+                    }
+                }
+                subtrees = std::move(children);
+            }
+
+            std::for_each(std::execution::par, medians.begin(), medians.end(), [&](const std::size_t &slot) -> void {
+                this->selfJoinPoint(join, slot, storage_.point(slot), root);
+            });
+            std::for_each(std::execution::par, subtrees.begin(), subtrees.end(),
+                          [&](const RangeEntry &subtree) -> void {
+                              this->selfJoin(join, subtree, root,
+                                             this->boxPairDistance(boxes_[subtree.node_], boxes_[root.node_]));
+                          });
+        }
+
+        neighbours.clear();
+        neighbours.resize(number_of_points);
+
+        std::vector<std::size_t> slots(number_of_points);
+        std::iota(slots.begin(), slots.end(), 0UL);
+        std::for_each(std::execution::par, slots.begin(), slots.end(), [&](const std::size_t &slot) -> void {
+            heapToSortedNeighbours(join.heaps_[slot], neighbours[storage_.index(slot)]);
+        });
+    }
+
+    void findNeighborsWithinRadius(const point_t &point, double search_radius, std::vector<point_t> &neighbors,
+                                   std::vector<double> &distances, bool return_sorted = true) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+
+        neighbors.clear();
+        distances.clear();
+
+        this->neighbourWithinRadiusSearch(point, search_radius,
+                                             [&](std::size_t slot, distance_t dist) -> void {
+                                                 neighbors.emplace_back(storage_.point(slot));
+                                                 distances.emplace_back(dist);
+                                             });
+
+        if (return_sorted && !neighbors.empty())
+        {
+            sortNeighborsByRadius(neighbors, distances);
+        }
+    }
+
+    void findNeighborsWithinRadius(const std::vector<point_t> &points, double search_radius,
+                                   std::vector<std::vector<point_t>> &neighbors,
+                                   std::vector<std::vector<double>> &distances, bool return_sorted = true) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+        else if (points.empty())
+        {
+            throw std::runtime_error("No points were provided");
+        }
+
+        const auto &number_of_points = points.size();
+
+        neighbors.clear();
+        distances.clear();
+
+        neighbors.resize(number_of_points);
+        distances.resize(number_of_points);
+
+        std::vector<std::size_t> indices;
+        indices.resize(number_of_points);
+        std::iota(indices.begin(), indices.end(), 0UL);
+
+        std::for_each(std::execution::par, indices.begin(), indices.end(), [&](const std::size_t &i) -> void {
+            this->neighbourWithinRadiusSearch(points[i], search_radius,
+                                                 [&](std::size_t slot, distance_t dist) -> void {
+                                                     neighbors[i].emplace_back(storage_.point(slot));
+                                                     distances[i].emplace_back(dist);
+                                                 });
+
+            if (return_sorted && !neighbors.empty())
+            {
+                sortNeighborsByRadius(neighbors[i], distances[i]);
+            }
+        });
+    }
+
+    void findNeighborsWithinRadius(const point_t &point, double search_radius, std::vector<neighbour_t> &neighbours,
+                                   bool return_sorted = true) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+
+        neighbours.clear();
+
+        this->neighbourWithinRadiusSearch(point, search_radius,
+                                             [&](std::size_t slot, distance_t dist) -> void {
+                                                 neighbours.emplace_back(storage_.index(slot), dist);
+                                             });
+
+        if (return_sorted)
+        {
+            sortNeighborsByRadius(neighbours);
+        }
+    }
+
+    void findNeighborsWithinRadius(const std::vector<point_t> &points, double search_radius,
+                                   std::vector<std::vector<neighbour_t>> &neighbours,
+                                   bool return_sorted = true) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+        else if (points.empty())
+        {
+            throw std::runtime_error("No points were provided");
+        }
+
+        const auto &number_of_points = points.size();
+
+        neighbours.clear();
+        neighbours.resize(number_of_points);
+
+        std::vector<std::size_t> indices;
+        indices.resize(number_of_points);
+        std::iota(indices.begin(), indices.end(), 0UL);
+
+        std::for_each(std::execution::par, indices.begin(), indices.end(), [&](const std::size_t &i) -> void {
+            this->neighbourWithinRadiusSearch(points[i], search_radius,
+                                                 [&](std::size_t slot, distance_t dist) -> void {
+                                                     neighbours[i].emplace_back(storage_.index(slot), dist);
+                                                 });
+
+            if (return_sorted)
+            {
+                sortNeighborsByRadius(neighbours[i]);
+            }
+        });
+    }
+
+    // Counts the neighbours of every query first and fills the flat arrays in a second pass, so the
+    // output vectors are allocated once instead of once per query
+    void findNeighborsWithinRadius(const std::vector<point_t> &points, double search_radius,
+                                   KDTreeRadiusNeighbours &neighbours, bool return_sorted = true) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+        else if (points.empty())
+        {
+            throw std::runtime_error("No points were provided");
+        }
+
+        const auto &number_of_points = points.size();
+
+        neighbours.offsets.assign(number_of_points + 1UL, 0UL);
+
+        std::vector<std::size_t> indices;
+        indices.resize(number_of_points);
+        std::iota(indices.begin(), indices.end(), 0UL);
+
+        std::for_each(std::execution::par, indices.begin(), indices.end(), [&](const std::size_t &i) -> void {
+            std::size_t count = 0UL;
+            this->neighbourWithinRadiusSearch(points[i], search_radius,
+                                                 [&count](std::size_t, distance_t) -> void { ++count; });
+            neighbours.offsets[i + 1UL] = count;
+        });
+
+        std::partial_sum(neighbours.offsets.begin(), neighbours.offsets.end(), neighbours.offsets.begin());
+        neighbours.indices.resize(neighbours.offsets.back());
+        neighbours.distances.resize(neighbours.offsets.back());
+
+        std::for_each(std::execution::par, indices.begin(), indices.end(), [&](const std::size_t &i) -> void {
+            // Reused by every query of a thread, so sorting a row does not allocate
+            thread_local std::vector<neighbour_t> row;
+            row.clear();
+            this->neighbourWithinRadiusSearch(points[i], search_radius,
+                                                 [&](std::size_t slot, distance_t dist) -> void {
+                                                     row.emplace_back(storage_.index(slot), dist);
+                                                 });
+
+            if (return_sorted)
+            {
+                sortNeighborsByRadius(row);
+            }
+
+            std::size_t position = neighbours.offsets[i];
+            for (const auto &neighbour : row)
+            {
+                neighbours.indices[position] = neighbour.first;
+                neighbours.distances[position] = neighbour.second;
+                ++position;
+            }
+        });
+    }
+
+    // Indices of all points inside the axis-aligned box [low, high], bounds included
+    void rangeQuery(const point_t &low, const point_t &high, std::vector<std::size_t> &indices) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+
+        indices.clear();
+        this->rangeSearch(
+            low, high,
+            [&](std::size_t begin, std::size_t end) -> void {
+                for (std::size_t slot = begin; slot < end; ++slot)
+                {
+                    indices.push_back(storage_.index(slot));
+                }
+            },
+            [&](std::size_t slot) -> void { indices.push_back(storage_.index(slot)); });
+    }
+
+    void rangeQuery(const point_t &low, const point_t &high, std::vector<point_t> &points) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+
+        points.clear();
+        this->rangeSearch(
+            low, high,
+            [&](std::size_t begin, std::size_t end) -> void {
+                for (std::size_t slot = begin; slot < end; ++slot)
+                {
+                    points.push_back(storage_.point(slot));
+                }
+            },
+            [&](std::size_t slot) -> void { points.push_back(storage_.point(slot)); });
+    }
+
+    // Number of points inside the box [low, high]. Subtrees inside the box are counted by their size.
+    std::size_t rangeCount(const point_t &low, const point_t &high) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+
+        std::size_t count = 0UL;
+        this->rangeSearch(
+            low, high, [&count](std::size_t begin, std::size_t end) -> void { count += end - begin; },
+            [&count](std::size_t) -> void { ++count; });
+        return count;
+    }
+
+    void rangeQuery(const std::vector<box_t> &boxes, std::vector<std::vector<std::size_t>> &indices) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+        const auto &number_of_boxes = boxes.size();
+
+        indices.clear();
+        indices.resize(number_of_boxes);
+
+        std::vector<std::size_t> box_indices;
+        box_indices.resize(number_of_boxes);
+        std::iota(box_indices.begin(), box_indices.end(), 0UL);
+
+        std::for_each(std::execution::par, box_indices.begin(), box_indices.end(), [&](const std::size_t &i) -> void {
+            this->rangeQuery(boxes[i].first, boxes[i].second, indices[i]);
+        });
+    }
+
+    void rangeCount(const std::vector<box_t> &boxes, std::vector<std::size_t> &counts) const
+    {
+        if (storage_.empty())
+        {
+            throw std::logic_error("Tree is empty");
+        }
+        const auto &number_of_boxes = boxes.size();
+
+        counts.clear();
+        counts.resize(number_of_boxes);
+
+        std::vector<std::size_t> box_indices;
+        box_indices.resize(number_of_boxes);
+        std::iota(box_indices.begin(), box_indices.end(), 0UL);
+
+        std::for_each(std::execution::par, box_indices.begin(), box_indices.end(), [&](const std::size_t &i) -> void {
+            counts[i] = this->rangeCount(boxes[i].first, boxes[i].second);
+        });
+    }
+
+    // Statistics summed up over all queries since the tree was built or the statistics were reset. Batched
+    // and threaded queries are counted once per point searched.
+    KDTreeQueryStats queryStats() const
+    {
+        static_assert(instrumented, "Query statistics need a tree with instrumentation enabled");
+        return total_stats_.load();
+    }
+
+    void resetQueryStats()
+    {
+        static_assert(instrumented, "Query statistics need a tree with instrumentation enabled");
+        total_stats_.reset();
+    }
+
+    // Statistics of the last query the calling thread ran on any tree of this type
+    static KDTreeQueryStats lastQueryStats()
+    {
+        static_assert(instrumented, "Query statistics need a tree with instrumentation enabled");
+        return lastStats();
+    }
+
+    void printTree() const
+    {
+        this->printTree("", 0UL, storage_.size(), false);
+    }
+
+    // Writes the coordinates, indices and split axes in tree order, so that open only has to map the file.
+    // The file is in the byte order of this machine.
+    void save(const std::string &path) const
+    {
+        static_assert(!std::is_same_v<Layout, StridedView>, "A view does not own the coordinates it would save");
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file)
+        {
+            throw std::runtime_error("Cannot open " + path + " for writing");
+        }
+
+        const KDTreeFileHeader header = fileHeader(storage_.size(), leaf_size_, split_rule_, axes_.size());
+        file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+        const auto sizes = fileSectionSizes(storage_.size(), axes_.size());
+        const auto offsets = fileOffsets(sizes);
+        std::vector<const void *> data;
+        for (const void *section : storage_.sectionData())
+        {
+            data.push_back(section);
+        }
+        data.push_back(axes_.data());
+        data.push_back(boxes_.data());
+
+        std::size_t position = sizeof(header);
+        const std::array<char, KDTREE_FILE_ALIGNMENT> padding{};
+        for (std::size_t i = 0UL; i < sizes.size(); ++i)
+        {
+            file.write(padding.data(), static_cast<std::streamsize>(offsets[i] - position));
+            file.write(static_cast<const char *>(data[i]), static_cast<std::streamsize>(sizes[i]));
+            position = offsets[i] + sizes[i];
+        }
+
+        if (!file)
+        {
+            throw std::runtime_error("Cannot write " + path);
+        }
+    }
+
+    // Opens a tree written by save. The coordinates and indices are used in place from the mapped file,
+    // which is shared by every copy of the tree and by all processes opening the same file; only the
+    // split axes, one byte per internal node, are copied. The metric is not part of the file.
+    static KDTree open(const std::string &path, const Metric &metric = Metric())
+    {
+        static_assert(!std::is_same_v<Layout, StridedView>, "A view does not own the coordinates it would open");
+
+        std::size_t file_size = 0UL;
+        const std::shared_ptr<const void> mapping = mapFile(path, file_size);
+        const auto *bytes = static_cast<const unsigned char *>(mapping.get());
+
+        KDTreeFileHeader header;
+        if (file_size < sizeof(header))
+        {
+            throw std::runtime_error(path + " is not a saved KDTree");
+        }
+        std::memcpy(&header, bytes, sizeof(header));
+
+        const KDTreeFileHeader expected =
+            fileHeader(header.size_, header.leaf_size_, static_cast<SplitRule>(header.split_rule_), header.axes_size_);
+        if (std::memcmp(&header, &expected, sizeof(header)) != 0 || header.leaf_size_ == 0UL)
+        {
+            throw std::runtime_error(path + " does not hold a KDTree of this type and version");
+        }
+
+        KDTree tree(metric);
+        tree.leaf_size_ = header.leaf_size_;
+        tree.split_rule_ = static_cast<SplitRule>(header.split_rule_);
+        if (tree.nodeCount(header.size_) != header.axes_size_)
+        {
+            throw std::runtime_error(path + " does not hold a KDTree of this type and version");
+        }
+
+        // Every point takes its coordinates and index in the file, which bounds the section sizes by a small
+        // multiple of the file size before they are computed, so that they cannot wrap around
+        if (header.size_ > file_size / (sizeof(point_t) + sizeof(std::size_t)))
+        {
+            throw std::runtime_error(path + " is truncated");
+        }
+        const auto sizes = fileSectionSizes(header.size_, header.axes_size_);
+        const auto offsets = fileOffsets(sizes);
+        if (offsets.back() + sizes.back() > file_size)
+        {
+            throw std::runtime_error(path + " is truncated");
+        }
+
+        std::array<const unsigned char *, KDTreeStorage<T, dim, Layout>::SECTION_COUNT> sections;
+        for (std::size_t i = 0UL; i < sections.size(); ++i)
+        {
+            sections[i] = bytes + offsets[i];
+        }
+        tree.storage_.map(mapping, sections, header.size_);
+        for (std::size_t slot = 0UL; slot < header.size_; ++slot)
+        {
+            if (tree.storage_.index(slot) >= header.size_)
+            {
+                throw std::runtime_error(path + " does not hold a KDTree of this type and version");
+            }
+        }
+        const std::size_t axes_offset = offsets[sections.size()];
+        tree.axes_.assign(bytes + axes_offset, bytes + axes_offset + header.axes_size_);
+        if (std::any_of(tree.axes_.begin(), tree.axes_.end(), [](std::uint8_t axis) -> bool { return axis >= dim; }))
+        {
+            throw std::runtime_error(path + " does not hold a KDTree of this type and version");
+        }
+        tree.boxes_.map(mapping, reinterpret_cast<const box_t *>(bytes + offsets.back()),
+                        boxCount(header.axes_size_));
+
+        return tree;
+    }
+
+  private:
+    // Point and its index in the input, partitioned together while building the tree
+    struct BuildEntry
+    {
+        point_t point_;
+        std::size_t index_;
+    };
+
+    // Range of a subtree waiting on the traversal stack with a lower bound on its distance
+    struct StackEntry
+    {
+        std::size_t begin_;
+        std::size_t end_;
+        std::size_t node_;
+        distance_t distance_;
+    };
+
+    // Slot range and node number of a subtree, as waiting on the range traversal stack
+    struct RangeEntry
+    {
+        std::size_t begin_;
+        std::size_t end_;
+        std::size_t node_;
+    };
+
+    struct NearestQuery
+    {
+        std::size_t best_;
+        distance_t best_dist_;
+
+        void visit(std::size_t slot, distance_t dist)
+        {
+            best_ = (dist < best_dist_) ? slot : best_;
+            best_dist_ = (dist < best_dist_) ? dist : best_dist_;
+        }
+
+        bool prune(distance_t distance) const
+        {
+            return distance >= best_dist_;
+        }
+    };
+
+    struct KNearestQuery
+    {
+        std::vector<std::pair<distance_t, std::size_t>> &heap_;
+        std::size_t k_;
+
+        void visit(std::size_t slot, distance_t dist)
+        {
+            pushToHeap(heap_, k_, dist, slot);
+        }
+
+        bool prune(distance_t distance) const
+        {
+            return heap_.size() == k_ && distance >= heap_.front().first;
+        }
+    };
+
+    // State of an all nearest neighbours self-join: the heap of the k nearest neighbours found so far for
+    // every slot, and for every subtree an upper bound on the k-th neighbour distance of all its points
+    struct SelfJoin
+    {
+        std::size_t k_;
+        std::vector<std::vector<std::pair<distance_t, std::size_t>>> heaps_;
+        std::vector<distance_t> bounds_;
+
+        distance_t bound(std::size_t slot) const
+        {
+            return (heaps_[slot].size() == k_) ? heaps_[slot].front().first : std::numeric_limits<distance_t>::max();
+        }
+    };
+
+    template <typename Visitor> struct RadiusQuery
+    {
+        distance_t search_radius_;
+        Visitor &visit_;
+
+        void visit(std::size_t slot, distance_t dist)
+        {
+            if (dist <= search_radius_ && dist != 0.0)
+            {
+                visit_(slot, dist);
+            }
+        }
+
+        bool prune(distance_t distance) const
+        {
+            return distance > search_radius_;
+        }
+    };
+
+    KDTreeStorage<T, dim, Layout> storage_;
+    Metric metric_;
+    std::vector<std::uint8_t> axes_;
+    KDTreeBuffer<box_t> boxes_;
+    std::size_t leaf_size_ = DEFAULT_LEAF_SIZE;
+    SplitRule split_rule_ = SplitRule::Cycle;
+    std::uint64_t seed_ = 0UL;
+    std::size_t grain_size_ = DEFAULT_GRAIN_SIZE;
+    std::size_t parallel_depth_ = DEFAULT_RECURSION_DEPTH;
+    mutable std::conditional_t<instrumented, KDTreeTotalQueryStats, KDTreeNoQueryStats> total_stats_;
+
+    // Only used by open, which fills in the members from a file
+    explicit KDTree(const Metric &metric) : metric_(metric)
+    {
+    }
+
+    static KDTreeQueryStats &lastStats()
+    {
+        thread_local KDTreeQueryStats stats;
+        return stats;
+    }
+
+    void recordQuery(const KDTreeQueryCounter<instrumented> &counter) const
+    {
+        if constexpr (instrumented)
+        {
+            lastStats() = counter.stats();
+            total_stats_.add(counter.stats());
+        }
+    }
+
+    static KDTreeBuildOptions defaultOptions(bool threaded)
+    {
+        KDTreeBuildOptions options;
+        options.threaded = threaded;
+        return options;
+    }
+
+    template <typename Iterator> static std::vector<BuildEntry> makeBuildEntries(Iterator begin, Iterator end)
+    {
+        std::vector<BuildEntry> nodes;
+        nodes.reserve(static_cast<std::size_t>(std::distance(begin, end)));
+        for (std::size_t index = 0UL; begin != end; ++begin, ++index)
+        {
+            nodes.push_back(BuildEntry{*begin, index});
+        }
+        return nodes;
+    }
+
+    // Header of a saved tree, with zeroed padding so that headers can be compared bytewise
+    static KDTreeFileHeader fileHeader(std::uint64_t size, std::uint64_t leaf_size, SplitRule split_rule,
+                                       std::uint64_t axes_size)
+    {
+        KDTreeFileHeader header;
+        std::memset(&header, 0, sizeof(header));
+        header.magic_ = KDTREE_FILE_MAGIC;
+        header.version_ = KDTREE_FILE_VERSION;
+        header.dim_ = static_cast<std::uint32_t>(dim);
+        header.coordinate_size_ = static_cast<std::uint32_t>(sizeof(T));
+        header.index_size_ = static_cast<std::uint32_t>(sizeof(std::size_t));
+        header.layout_ = KDTreeStorage<T, dim, Layout>::LAYOUT_ID;
+        header.split_rule_ = static_cast<std::uint32_t>(split_rule);
+        header.size_ = size;
+        header.leaf_size_ = leaf_size;
+        header.axes_size_ = axes_size;
+        return header;
+    }
+
+    // Sizes in bytes of the storage sections followed by the split axes and the bounding box
+    static std::vector<std::size_t> fileSectionSizes(std::size_t count, std::size_t axes_size)
+    {
+        const auto storage_sizes = KDTreeStorage<T, dim, Layout>::sectionSizes(count);
+        std::vector<std::size_t> sizes(storage_sizes.begin(), storage_sizes.end());
+        sizes.push_back(axes_size);
+        sizes.push_back(boxCount(axes_size) * sizeof(box_t));
+        return sizes;
+    }
+
+    // Offsets of the sections, which follow the header at aligned positions
+    static std::vector<std::size_t> fileOffsets(const std::vector<std::size_t> &sizes)
+    {
+        std::vector<std::size_t> offsets;
+        std::size_t offset = sizeof(KDTreeFileHeader);
+        for (const std::size_t size : sizes)
+        {
+            offset = (offset + KDTREE_FILE_ALIGNMENT - 1UL) / KDTREE_FILE_ALIGNMENT * KDTREE_FILE_ALIGNMENT;
+            offsets.push_back(offset);
+            offset += size;
+        }
+        return offsets;
+    }
+
+    // Maps a whole file read-only, or reads it into memory where mmap is not available
+    static std::shared_ptr<const void> mapFile(const std::string &path, std::size_t &size)
+    {
+#ifdef KDTREE_USE_MMAP
+        const int descriptor = ::open(path.c_str(), O_RDONLY);
+        if (descriptor < 0)
+        {
+            throw std::runtime_error("Cannot open " + path);
+        }
+
+        struct stat status;
+        if (::fstat(descriptor, &status) != 0 || status.st_size == 0)
+        {
+            ::close(descriptor);
+            throw std::runtime_error(path + " is not a saved KDTree");
+        }
+        size = static_cast<std::size_t>(status.st_size);
+
+        void *address = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, descriptor, 0);
+        ::close(descriptor);
+        if (address == MAP_FAILED)
+        {
+            throw std::runtime_error("Cannot map " + path);
+        }
+
+        return std::shared_ptr<const void>(address, [size](const void *mapped) -> void {
+            ::munmap(const_cast<void *>(mapped), size);
+        });
+#else
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file)
+        {
+            throw std::runtime_error("Cannot open " + path);
+        }
+        size = static_cast<std::size_t>(file.tellg());
+        file.seekg(0);
+
+        auto contents = std::make_shared<std::vector<unsigned char>>(size);
+        file.read(reinterpret_cast<char *>(contents->data()), static_cast<std::streamsize>(size));
+        return std::shared_ptr<const void>(contents, contents->data());
+#endif
+    }
+
+    // Coordinates of a point being partitioned, copied into the entry or read through the input index
+    T entryCoordinate(const BuildEntry &entry, std::size_t axis) const
+    {
+        return entry.point_[axis];
+    }
+
+    T entryCoordinate(std::size_t index, std::size_t axis) const
+    {
+        return storage_.inputCoordinate(index, axis);
+    }
+
+    // Points are partitioned in an array of structs and then permuted into the storage layout. A view
+    // partitions the input indices only.
+    template <typename Entry> void build(std::vector<Entry> &&nodes, const KDTreeBuildOptions &options)
+    {
+        if (leaf_size_ == 0UL)
+        {
+            throw std::invalid_argument("Leaf size must be positive");
+        }
+
+        axes_.assign(this->nodeCount(nodes.size()), 0U);
+        if (options.threaded)
+        {
+            // hardware_concurrency may report 0 when the number of threads is unknown
+            const std::size_t thread_count =
+                (options.thread_count > 0UL)
+                    ? options.thread_count
+                    : std::max<std::size_t>(std::thread::hardware_concurrency(), 1UL);
+
+            // Until there is a subtree per thread, single ranges are partitioned in parallel
+            grain_size_ = std::max(options.grain_size, leaf_size_);
+            parallel_depth_ = static_cast<std::size_t>(std::floor(std::log2(thread_count)));
+
+#ifdef KDTREE_USE_TBB
+            tbb::task_arena arena(static_cast<int>(thread_count));
+            arena.execute([&]() -> void { buildTreeParallel(nodes, 0UL, nodes.size(), 0UL, 0UL, 0UL); });
+#else
+            buildTreeParallel(nodes, 0UL, nodes.size(), 0UL, 0UL, 0UL);
+#endif
+        }
+        else
+        {
+            buildTree(nodes, 0UL, nodes.size(), 0UL, 0UL);
+        }
+
+        this->storeEntries(std::move(nodes));
+
+        std::vector<box_t> boxes(boxCount(axes_.size()));
+        this->computeBoxes(boxes, 0UL, storage_.size(), 0UL);
+        boxes_.assign(std::move(boxes));
+    }
+
+    // Bounding box of every subtree, numbered like the internal nodes and including the leaves below them.
+    // The boxes of empty ranges are never read.
+    box_t computeBoxes(std::vector<box_t> &boxes, std::size_t begin, std::size_t end, std::size_t node) const
+    {
+        if (end <= begin)
+        {
+            return box_t{};
+        }
+
+        box_t box;
+        if (this->isLeaf(begin, end))
+        {
+            box.first = storage_.point(begin);
+            box.second = box.first;
+            for (std::size_t slot = begin + 1UL; slot < end; ++slot)
+            {
+                this->extendBox(box, storage_.point(slot));
+            }
+        }
+        else
+        {
+            const std::size_t middle = begin + (end - begin) / 2;
+            box = this->computeBoxes(boxes, begin, middle, leftChild(node));
+            this->extendBox(box, storage_.point(middle));
+            if (end > middle + 1UL)
+            {
+                const box_t right = this->computeBoxes(boxes, middle + 1UL, end, rightChild(node));
+                this->extendBox(box, right.first);
+                this->extendBox(box, right.second);
+            }
+        }
+        boxes[node] = box;
+        return box;
+    }
+
+    static void extendBox(box_t &box, const point_t &point)
+    {
+        for (std::size_t axis = 0; axis < dim; ++axis)
+        {
+            box.first[axis] = std::min(box.first[axis], point[axis]);
+            box.second[axis] = std::max(box.second[axis], point[axis]);
+        }
+    }
+
+    // Lower bound on the distance from point to every point in box
+    distance_t boxDistance(const point_t &point, const box_t &box) const
+    {
+        distance_t dist = 0;
+        for (std::size_t axis = 0; axis < dim; ++axis)
+        {
+            dist = Metric::accumulate(
+                dist, metric_.intervalDistance(static_cast<distance_t>(point[axis]),
+                                               static_cast<distance_t>(box.first[axis]),
+                                               static_cast<distance_t>(box.second[axis]), axis));
+        }
+        return dist;
+    }
+
+    void storeEntries(std::vector<BuildEntry> &&nodes)
+    {
+        std::vector<point_t> points;
+        std::vector<std::size_t> indices;
+        points.reserve(nodes.size());
+        indices.reserve(nodes.size());
+        for (const auto &node : nodes)
+        {
+            points.push_back(node.point_);
+            indices.push_back(node.index_);
+        }
+        nodes.clear();
+        nodes.shrink_to_fit();
+
+        storage_.assign(std::move(points), std::move(indices));
+    }
+
+    void storeEntries(std::vector<std::size_t> &&nodes)
+    {
+        storage_.assign(std::move(nodes));
+    }
+
+    bool isLeaf(std::size_t begin, std::size_t end) const
+    {
+        return (end - begin) <= leaf_size_;
+    }
+
+    // Internal nodes are numbered like a binary heap, starting with the root at 0
+    static std::size_t leftChild(std::size_t node)
+    {
+        return 2UL * node + 1UL;
+    }
+
+    static std::size_t rightChild(std::size_t node)
+    {
+        return 2UL * node + 2UL;
+    }
+
+    // Number of boxes, one for the root and one for each child of an internal node
+    static std::size_t boxCount(std::size_t node_count)
+    {
+        return 2UL * node_count + 1UL;
+    }
+
+    // Upper bound on the heap number of an internal node. The left subtree of a range of n points holds
+    // n / 2 points and the right one at most as many, so the deepest internal nodes lie along the left spine.
+    std::size_t nodeCount(std::size_t number_of_points) const
+    {
+        std::size_t count = 0UL;
+        for (std::size_t size = number_of_points; size > leaf_size_; size /= 2UL)
+        {
+            count = 2UL * count + 1UL;
+        }
+        return count;
+    }
+
+    // Splitting axis of the range [begin, end). The cyclic rule keeps the axis proposed by the parent,
+    // the other rules pick the axis along which the points of the range are spread the most, or one of the
+    // most spread ones at random.
+    template <typename Entry>
+    std::size_t selectSplitAxis(const std::vector<Entry> &nodes, std::size_t begin, std::size_t end,
+                                std::size_t index) const
+    {
+        if (split_rule_ == SplitRule::Cycle)
+        {
+            return index;
+        }
+
+        std::array<double, dim> spread;
+        if (split_rule_ == SplitRule::MaxSpread)
+        {
+            point_t min_point;
+            point_t max_point;
+            for (std::size_t axis = 0; axis < dim; ++axis)
+            {
+                min_point[axis] = this->entryCoordinate(nodes[begin], axis);
+                max_point[axis] = min_point[axis];
+            }
+            for (std::size_t i = begin + 1; i < end; ++i)
+            {
+                for (std::size_t axis = 0; axis < dim; ++axis)
+                {
+                    min_point[axis] = std::min(min_point[axis], this->entryCoordinate(nodes[i], axis));
+                    max_point[axis] = std::max(max_point[axis], this->entryCoordinate(nodes[i], axis));
+                }
+            }
+            for (std::size_t axis = 0; axis < dim; ++axis)
+            {
+                spread[axis] = static_cast<double>(max_point[axis]) - static_cast<double>(min_point[axis]);
+            }
+        }
+        else
+        {
+            // Variance around the first point of the range, which keeps the sums well conditioned
+            std::array<double, dim> sum{};
+            std::array<double, dim> sum_squared{};
+            for (std::size_t i = begin; i < end; ++i)
+            {
+                for (std::size_t axis = 0; axis < dim; ++axis)
+                {
+                    const double delta = static_cast<double>(this->entryCoordinate(nodes[i], axis)) -
+                                         this->entryCoordinate(nodes[begin], axis);
+                    sum[axis] += delta;
+                    sum_squared[axis] += delta * delta;
+                }
+            }
+            const double count = static_cast<double>(end - begin);
+            for (std::size_t axis = 0; axis < dim; ++axis)
+            {
+                spread[axis] = sum_squared[axis] / count - (sum[axis] / count) * (sum[axis] / count);
+            }
+        }
+
+        if (split_rule_ == SplitRule::RandomizedVariance)
+        {
+            std::array<std::size_t, dim> axes;
+            std::iota(axes.begin(), axes.end(), 0UL);
+            const std::size_t candidates = std::min(RANDOMIZED_SPLIT_AXES, dim);
+            std::partial_sort(
+                axes.begin(), axes.begin() + candidates, axes.end(),
+                [&spread](std::size_t lhs, std::size_t rhs) -> bool { return spread[lhs] > spread[rhs]; });
+
+            // Axes without any variance would not separate the points
+            std::size_t spread_axes = 1UL;
+            while (spread_axes < candidates && spread[axes[spread_axes]] > 0.0)
+            {
+                ++spread_axes;
+            }
+            return axes[this->rangeHash(begin, end) % spread_axes];
+        }
+
+        return static_cast<std::size_t>(std::distance(spread.begin(), std::max_element(spread.begin(), spread.end())));
+    }
+
+    // Pseudo-random number of the range [begin, end) derived from the seed by SplitMix64. It depends on the
+    // range only, so that threaded and sequential builds draw the same axes.
+    std::uint64_t rangeHash(std::size_t begin, std::size_t end) const
+    {
+        std::uint64_t hash = seed_ + 0x9E3779B97F4A7C15ULL * (1ULL + begin + (static_cast<std::uint64_t>(end) << 32));
+        hash = (hash ^ (hash >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        hash = (hash ^ (hash >> 27)) * 0x94D049BB133111EBULL;
+        return hash ^ (hash >> 31);
+    }
+
+    void printPoint(const point_t &point) const
+    {
+        auto point_it = point.begin();
+        std::cout << "(";
+        for (; point_it != point.end() - 1; ++point_it)
+        {
+            std::cout << std::setprecision(2) << std::scientific << *point_it << " ";
+        }
+        std::cout << std::setprecision(2) << std::scientific << *point_it << ")";
+    }
+
+    void printTree(const std::string &prefix, std::size_t begin, std::size_t end, bool is_left) const
+    {
+        if (end > begin)
+        {
+            std::cout << prefix;
+
+            std::cout << (is_left ? "├──" : "└──");
+
+            // print all points of a leaf bucket on one line
+            if (this->isLeaf(begin, end))
+            {
+                std::cout << "[";
+                for (std::size_t i = begin; i < end; ++i)
+                {
+                    this->printPoint(storage_.point(i));
+                    std::cout << ((i + 1 < end) ? " " : "");
+                }
+                std::cout << "]" << std::endl;
+                return;
+            }
+
+            // print the value of the node
+            const std::size_t middle = begin + (end - begin) / 2;
+            this->printPoint(storage_.point(middle));
+            std::cout << std::endl;
+
+            // enter the next tree level - left and right branch
+            this->printTree(prefix + (is_left ? "│   " : "    "), begin, middle, true);
+            this->printTree(prefix + (is_left ? "│   " : "    "), middle + 1, end, false);
+        }
+    }
+
+    template <typename Entry>
+    void buildTree(std::vector<Entry> &nodes, std::size_t begin, std::size_t end, std::size_t node,
+                   std::size_t index)
+    {
+        if (this->isLeaf(begin, end))
+        {
+            return;
+        }
+
+        index = this->selectSplitAxis(nodes, begin, end, index);
+        axes_[node] = static_cast<std::uint8_t>(index);
+
+        std::size_t middle = begin + (end - begin) / 2;
+        auto nodes_it = nodes.begin();
+        std::nth_element(nodes_it + begin, nodes_it + middle, nodes_it + end,
+                         [this, &index](const Entry &pt_1, const Entry &pt_2) -> bool {
+                             return this->entryCoordinate(pt_1, index) < this->entryCoordinate(pt_2, index);
+                         });
+
+        index = (index + 1) % dim;
+        this->buildTree(nodes, begin, middle, leftChild(node), index);
+        this->buildTree(nodes, middle + 1, end, rightChild(node), index);
+    }
+
+    // Splits ranges larger than the grain size into two tasks, which TBB balances by work stealing.
+    // Without TBB every split up to the parallel depth starts an std::async thread instead.
+    template <typename Entry>
+    void buildTreeParallel(std::vector<Entry> &nodes, std::size_t begin, std::size_t end, std::size_t node,
+                           std::size_t index, std::size_t recursion_depth)
+    {
+        // sequential
+#ifdef KDTREE_USE_TBB
+        if (end - begin <= grain_size_)
+#else
+        if (end - begin <= grain_size_ || recursion_depth > parallel_depth_)
+#endif
+        {
+            buildTree(nodes, begin, end, node, index);
+        }
+        // parallel
+        else
+        {
+            index = this->selectSplitAxis(nodes, begin, end, index);
+            axes_[node] = static_cast<std::uint8_t>(index);
+
+            std::size_t middle = begin + (end - begin) / 2;
+            auto nodes_it = nodes.begin();
+            auto compare = [this, &index](const Entry &pt_1, const Entry &pt_2) -> bool {
+                return this->entryCoordinate(pt_1, index) < this->entryCoordinate(pt_2, index);
+            };
+            if (recursion_depth < parallel_depth_)
+            {
+                std::nth_element(std::execution::par, nodes_it + begin, nodes_it + middle, nodes_it + end, compare);
+            }
+            else
+            {
+                std::nth_element(nodes_it + begin, nodes_it + middle, nodes_it + end, compare);
+            }
+
+            index = (index + 1) % dim;
+
+#ifdef KDTREE_USE_TBB
+            tbb::parallel_invoke(
+                [&]() -> void {
+                    this->buildTreeParallel(nodes, begin, middle, leftChild(node), index, recursion_depth + 1);
+                },
+                [&]() -> void {
+                    this->buildTreeParallel(nodes, middle + 1, end, rightChild(node), index, recursion_depth + 1);
+                });
+#else
+            std::future<void> future = std::async(std::launch::async, [&]() {
+                this->buildTreeParallel(nodes, begin, middle, leftChild(node), index, recursion_depth + 1);
+            });
+
+            this->buildTreeParallel(nodes, middle + 1, end, rightChild(node), index, recursion_depth + 1);
+            future.get();
+#endif
+        }
+    }
+
+    // Calls visit(slot, distance) for every point of the leaf bucket [begin, end), computing the
+    // distances in blocks of at most LEAF_SCAN_BLOCK_SIZE points
+    template <typename Visitor>
+    void scanLeaf(std::size_t begin, std::size_t end, const point_t &point, Visitor &&visit) const
+    {
+        std::array<distance_t, LEAF_SCAN_BLOCK_SIZE> distances;
+        for (std::size_t block = begin; block < end; block += LEAF_SCAN_BLOCK_SIZE)
+        {
+            const std::size_t block_end = std::min(block + LEAF_SCAN_BLOCK_SIZE, end);
+            storage_.distances(block, block_end, point, metric_, distances.data());
+            for (std::size_t i = block; i < block_end; ++i)
+            {
+                visit(i, distances[i - block]);
+            }
+        }
+    }
+
+    // Depth-first traversal with an explicit stack. The query receives visit(slot, distance) for
+    // every point reached and decides with prune(lower bound) whether a subtree can still contain a result.
+    // The closer child is entered directly, the farther one is pushed together with the lower bound on its
+    // distance from the splitting plane, so that it is skipped cheaply on pop once the query bound has shrunk
+    // below it. Otherwise the bound is tightened to the distance of its bounding box, which prunes far more
+    // when the points do not fill the cells of the partition, as for clustered data. At most one
+    // entry per tree level is on the stack, and the implicit tree is balanced, so MAX_TREE_DEPTH entries
+    // are enough for any number of points.
+    //
+    // Approximate searches scale the lower bounds by (1 + epsilon)^2, so that a subtree is only entered if
+    // it may contain a point closer than the current bound divided by (1 + epsilon), and stop after
+    // max_leaves leaf buckets. The first leaf scanned is always the one containing the query point.
+    template <typename Query>
+    void searchTree(const point_t &point, Query &query,
+                    const KDTreeSearchOptions &options = KDTreeSearchOptions()) const
+    {
+        const bool approximate = options.epsilon > 0.0;
+        const double scale = metric_.reduce(1.0 + options.epsilon);
+        std::size_t leaves = 0UL;
+        KDTreeQueryCounter<instrumented> counter;
+
+        std::array<StackEntry, MAX_TREE_DEPTH> stack;
+        std::size_t stack_size = 0UL;
+        stack[stack_size++] = StackEntry{0UL, storage_.size(), 0UL, distance_t(0)};
+
+        // Every subtree is at least as far away as its bounding box
+        auto subtreeDistance = [&](std::size_t node) -> distance_t {
+            const distance_t dist = this->boxDistance(point, boxes_[node]);
+            return approximate ? static_cast<distance_t>(dist * scale) : dist;
+        };
+
+        while (stack_size > 0UL)
+        {
+            const StackEntry entry = stack[--stack_size];
+            if (query.prune(entry.distance_))
+            {
+                counter.prune();
+                continue;
+            }
+
+            // A leaf bucket is scanned without testing its box, which rarely prunes what the plane did not
+            distance_t node_distance = entry.distance_;
+            if (!this->isLeaf(entry.begin_, entry.end_))
+            {
+                node_distance = std::max(node_distance, subtreeDistance(entry.node_));
+                if (query.prune(node_distance))
+                {
+                    counter.prune();
+                    continue;
+                }
+            }
+
+            std::size_t begin = entry.begin_;
+            std::size_t end = entry.end_;
+            std::size_t node = entry.node_;
+            while (end > begin)
+            {
+                if (this->isLeaf(begin, end))
+                {
+                    this->scanLeaf(begin, end, point,
+                                   [&query](std::size_t slot, distance_t dist) -> void { query.visit(slot, dist); });
+                    counter.scanLeaf(end - begin);
+                    if (++leaves == options.max_leaves)
+                    {
+                        this->recordQuery(counter);
+                        return;
+                    }
+                    break;
+                }
+
+                const std::size_t middle = begin + (end - begin) / 2;
+                const std::size_t axis = axes_[node];
+                const distance_t coordinate = static_cast<distance_t>(point[axis]);
+                const distance_t split = static_cast<distance_t>(storage_.coordinate(middle, axis));
+                const distance_t delta = split - coordinate;
+
+                query.visit(middle, storage_.distance(middle, point, metric_));
+                counter.visitNode();
+                counter.evaluate();
+                if (query.prune(node_distance))
+                {
+                    counter.prune();
+                    break;
+                }
+
+                // The far side is at least as far away as the splitting plane and the box of this subtree,
+                // its own box is only tested once it is popped
+                distance_t plane_distance = metric_.splitDistance(coordinate, split, axis);
+                if (approximate)
+                {
+                    plane_distance = static_cast<distance_t>(plane_distance * scale);
+                }
+                const distance_t far_distance = std::max(node_distance, plane_distance);
+                if (!query.prune(far_distance))
+                {
+                    stack[stack_size++] = (delta > 0.0)
+                                              ? StackEntry{middle + 1, end, rightChild(node), far_distance}
+                                              : StackEntry{begin, middle, leftChild(node), far_distance};
+                    counter.stackDepth(stack_size);
+                }
+                else
+                {
+                    counter.prune();
+                }
+
+                if (delta > 0.0)
+                {
+                    end = middle;
+                    node = leftChild(node);
+                }
+                else
+                {
+                    begin = middle + 1;
+                    node = rightChild(node);
+                }
+            }
+        }
+        this->recordQuery(counter);
+    }
+
+    distance_t pointDistance(const point_t &point, const point_t &other) const
+    {
+        distance_t dist = 0;
+        for (std::size_t axis = 0; axis < dim; ++axis)
+        {
+            const distance_t delta = static_cast<distance_t>(other[axis]) - static_cast<distance_t>(point[axis]);
+            dist = Metric::accumulate(dist, metric_.axisDistance(delta, axis));
+        }
+        return dist;
+    }
+
+    // Smallest bound of a nearest neighbour search that still accepts points at the given reduced distance,
+    // as the search only accepts points strictly closer than its bound
+    static distance_t inclusiveBound(double distance)
+    {
+        if (!(distance < static_cast<double>(std::numeric_limits<distance_t>::max())))
+        {
+            return std::numeric_limits<distance_t>::max();
+        }
+        if constexpr (std::is_floating_point_v<distance_t>)
+        {
+            return std::nextafter(static_cast<distance_t>(distance), std::numeric_limits<distance_t>::max());
+        }
+        else
+        {
+            return static_cast<distance_t>(std::floor(distance)) + 1;
+        }
+    }
+
+    // Lower bound on the distance between any two points of the boxes, the distance of 0 to the interval of
+    // differences along every axis
+    distance_t boxPairDistance(const box_t &lhs, const box_t &rhs) const
+    {
+        distance_t dist = 0;
+        for (std::size_t axis = 0; axis < dim; ++axis)
+        {
+            const distance_t low =
+                static_cast<distance_t>(rhs.first[axis]) - static_cast<distance_t>(lhs.second[axis]);
+            const distance_t high =
+                static_cast<distance_t>(rhs.second[axis]) - static_cast<distance_t>(lhs.first[axis]);
+            dist = Metric::accumulate(dist, metric_.intervalDistance(distance_t(0), low, high, axis));
+        }
+        return dist;
+    }
+
+    // Joins the points of the query subtree with the points of the reference subtree at the given box
+    // distance. The larger subtree is split, the query subtree on ties, and its median is joined with the
+    // other subtree as a single point.
+    void selfJoin(SelfJoin &join, const RangeEntry &query, const RangeEntry &reference, distance_t distance) const
+    {
+        if (distance >= join.bounds_[query.node_])
+        {
+            return;
+        }
+
+        const bool query_leaf = this->isLeaf(query.begin_, query.end_);
+        const bool reference_leaf = this->isLeaf(reference.begin_, reference.end_);
+        if (query_leaf && reference_leaf)
+        {
+            for (std::size_t slot = query.begin_; slot < query.end_; ++slot)
+            {
+                const point_t point = storage_.point(slot);
+                if (this->boxDistance(point, boxes_[reference.node_]) >= join.bound(slot))
+                {
+                    continue;
+                }
+                this->scanLeaf(reference.begin_, reference.end_, point,
+                               [&join, slot](std::size_t other, distance_t dist) -> void {
+                                   if (other != slot)
+                                   {
+                                       pushToHeap(join.heaps_[slot], join.k_, dist, other);
+                                   }
+                               });
+            }
+        }
+        else if (!query_leaf &&
+                 (reference_leaf || query.end_ - query.begin_ >= reference.end_ - reference.begin_))
+        {
+            const std::size_t middle = query.begin_ + (query.end_ - query.begin_) / 2;
+            this->selfJoinPoint(join, middle, storage_.point(middle), reference);
+
+            const RangeEntry left{query.begin_, middle, leftChild(query.node_)};
+            this->selfJoin(join, left, reference, this->boxPairDistance(boxes_[left.node_], boxes_[reference.node_]));
+            const RangeEntry right{middle + 1UL, query.end_, rightChild(query.node_)};
+            if (right.end_ > right.begin_)
+            {
+                this->selfJoin(join, right, reference,
+                               this->boxPairDistance(boxes_[right.node_], boxes_[reference.node_]));
+            }
+        }
+        else
+        {
+            const std::size_t middle = reference.begin_ + (reference.end_ - reference.begin_) / 2;
+            this->selfJoinReference(join, query, middle, storage_.point(middle));
+
+            // The closer child first, so that the bound has shrunk for the farther one
+            RangeEntry near{reference.begin_, middle, leftChild(reference.node_)};
+            RangeEntry far{middle + 1UL, reference.end_, rightChild(reference.node_)};
+            distance_t near_distance = this->boxPairDistance(boxes_[query.node_], boxes_[near.node_]);
+            distance_t far_distance = std::numeric_limits<distance_t>::max();
+            if (far.end_ > far.begin_)
+            {
+                far_distance = this->boxPairDistance(boxes_[query.node_], boxes_[far.node_]);
+                if (far_distance < near_distance)
+                {
+                    std::swap(near, far);
+                    std::swap(near_distance, far_distance);
+                }
+            }
+            this->selfJoin(join, query, near, near_distance);
+            if (far.end_ > far.begin_)
+            {
+                this->selfJoin(join, query, far, far_distance);
+            }
+        }
+        this->updateSelfJoinBound(join, query);
+    }
+
+    // Joins the single point in slot with the points of the reference subtree
+    void selfJoinPoint(SelfJoin &join, std::size_t slot, const point_t &point, const RangeEntry &reference) const
+    {
+        if (this->boxDistance(point, boxes_[reference.node_]) >= join.bound(slot))
+        {
+            return;
+        }
+
+        auto visit = [&join, slot](std::size_t other, distance_t dist) -> void {
+            if (other != slot)
+            {
+                pushToHeap(join.heaps_[slot], join.k_, dist, other);
+            }
+        };
+        if (this->isLeaf(reference.begin_, reference.end_))
+        {
+            this->scanLeaf(reference.begin_, reference.end_, point, visit);
+            return;
+        }
+
+        const std::size_t middle = reference.begin_ + (reference.end_ - reference.begin_) / 2;
+        visit(middle, storage_.distance(middle, point, metric_));
+
+        const RangeEntry left{reference.begin_, middle, leftChild(reference.node_)};
+        const RangeEntry right{middle + 1UL, reference.end_, rightChild(reference.node_)};
+        const std::size_t axis = axes_[reference.node_];
+        const bool left_first = point[axis] < storage_.coordinate(middle, axis);
+        if (left_first)
+        {
+            this->selfJoinPoint(join, slot, point, left);
+        }
+        if (right.end_ > right.begin_)
+        {
+            this->selfJoinPoint(join, slot, point, right);
+        }
+        if (!left_first)
+        {
+            this->selfJoinPoint(join, slot, point, left);
+        }
+    }
+
+    // Joins the points of the query subtree with the single reference point in slot
+    void selfJoinReference(SelfJoin &join, const RangeEntry &query, std::size_t slot, const point_t &point) const
+    {
+        if (this->boxDistance(point, boxes_[query.node_]) >= join.bounds_[query.node_])
+        {
+            return;
+        }
+
+        auto visit = [&join, slot](std::size_t other, distance_t dist) -> void {
+            if (other != slot)
+            {
+                pushToHeap(join.heaps_[other], join.k_, dist, slot);
+            }
+        };
+        if (this->isLeaf(query.begin_, query.end_))
+        {
+            this->scanLeaf(query.begin_, query.end_, point, visit);
+        }
+        else
+        {
+            const std::size_t middle = query.begin_ + (query.end_ - query.begin_) / 2;
+            visit(middle, storage_.distance(middle, point, metric_));
+            this->selfJoinReference(join, RangeEntry{query.begin_, middle, leftChild(query.node_)}, slot, point);
+            if (query.end_ > middle + 1UL)
+            {
+                this->selfJoinReference(join, RangeEntry{middle + 1UL, query.end_, rightChild(query.node_)}, slot,
+                                        point);
+            }
+        }
+        this->updateSelfJoinBound(join, query);
+    }
+
+    // The bound of a subtree is the largest bound of its points, taken from its children for internal nodes
+    void updateSelfJoinBound(SelfJoin &join, const RangeEntry &query) const
+    {
+        distance_t bound = 0;
+        if (this->isLeaf(query.begin_, query.end_))
+        {
+            for (std::size_t slot = query.begin_; slot < query.end_; ++slot)
+            {
+                bound = std::max(bound, join.bound(slot));
+            }
+        }
+        else
+        {
+            const std::size_t middle = query.begin_ + (query.end_ - query.begin_) / 2;
+            bound = std::max(join.bound(middle), join.bounds_[leftChild(query.node_)]);
+            if (query.end_ > middle + 1UL)
+            {
+                bound = std::max(bound, join.bounds_[rightChild(query.node_)]);
+            }
+        }
+        join.bounds_[query.node_] = bound;
+    }
+
+    // Order in which a batch of queries is processed, by the first slot of the leaf bucket every query point
+    // falls into if the queries are sorted
+    std::vector<std::size_t> queryOrder(const std::vector<point_t> &points, const KDTreeSearchOptions &options) const
+    {
+        std::vector<std::size_t> order(points.size());
+        std::iota(order.begin(), order.end(), 0UL);
+        if (!options.sort_queries)
+        {
+            return order;
+        }
+
+        std::vector<std::size_t> leaves(points.size());
+        std::for_each(std::execution::par, order.begin(), order.end(),
+                      [&](const std::size_t &i) -> void { leaves[i] = this->leafSlot(points[i]); });
+        std::stable_sort(std::execution::par, order.begin(), order.end(),
+                         [&leaves](std::size_t lhs, std::size_t rhs) -> bool { return leaves[lhs] < leaves[rhs]; });
+        return order;
+    }
+
+    // First slot of the leaf bucket reached by descending towards point, the one scanned first by a search
+    std::size_t leafSlot(const point_t &point) const
+    {
+        std::size_t begin = 0UL;
+        std::size_t end = storage_.size();
+        std::size_t node = 0UL;
+        while (!this->isLeaf(begin, end))
+        {
+            const std::size_t middle = begin + (end - begin) / 2;
+            const std::size_t axis = axes_[node];
+            if (point[axis] < storage_.coordinate(middle, axis))
+            {
+                end = middle;
+                node = leftChild(node);
+            }
+            else
+            {
+                begin = middle + 1;
+                node = rightChild(node);
+            }
+        }
+        return begin;
+    }
+
+    // Depth-first traversal for the box [low, high], testing the bounding box of every subtree against it.
+    // Subtrees inside the query box are reported as whole slot ranges by visit_range(begin, end) without
+    // testing their points, all other points inside the query box by visit_point(slot). Both children may be
+    // entered, so the farther one is pushed while the nearer is descended, which again needs at most one
+    // stack entry per tree level.
+    template <typename RangeVisitor, typename PointVisitor>
+    void rangeSearch(const point_t &low, const point_t &high, RangeVisitor &&visit_range,
+                     PointVisitor &&visit_point) const
+    {
+        auto inside = [&low, &high](const point_t &point) -> bool {
+            for (std::size_t axis = 0; axis < dim; ++axis)
+            {
+                if (point[axis] < low[axis] || point[axis] > high[axis])
+                {
+                    return false;
+                }
+            }
+            return true;
+        };
+        auto contains = [&low, &high](const box_t &box) -> bool {
+            for (std::size_t axis = 0; axis < dim; ++axis)
+            {
+                if (box.first[axis] < low[axis] || box.second[axis] > high[axis])
+                {
+                    return false;
+                }
+            }
+            return true;
+        };
+        auto overlaps = [&low, &high](const box_t &box) -> bool {
+            for (std::size_t axis = 0; axis < dim; ++axis)
+            {
+                if (box.second[axis] < low[axis] || box.first[axis] > high[axis])
+                {
+                    return false;
+                }
+            }
+            return true;
+        };
+
+        KDTreeQueryCounter<instrumented> counter;
+        std::array<RangeEntry, MAX_TREE_DEPTH> stack;
+        std::size_t stack_size = 0UL;
+        if (storage_.empty() || !overlaps(boxes_[0UL]))
+        {
+            counter.prune();
+            this->recordQuery(counter);
+            return;
+        }
+        stack[stack_size++] = RangeEntry{0UL, storage_.size(), 0UL};
+
+        while (stack_size > 0UL)
+        {
+            RangeEntry entry = stack[--stack_size];
+            while (entry.end_ > entry.begin_)
+            {
+                if (contains(boxes_[entry.node_]))
+                {
+                    visit_range(entry.begin_, entry.end_);
+                    counter.visitNode();
+                    break;
+                }
+
+                if (this->isLeaf(entry.begin_, entry.end_))
+                {
+                    for (std::size_t slot = entry.begin_; slot < entry.end_; ++slot)
+                    {
+                        if (inside(storage_.point(slot)))
+                        {
+                            visit_point(slot);
+                        }
+                    }
+                    counter.scanLeaf(entry.end_ - entry.begin_);
+                    break;
+                }
+
+                const std::size_t middle = entry.begin_ + (entry.end_ - entry.begin_) / 2;
+                if (inside(storage_.point(middle)))
+                {
+                    visit_point(middle);
+                }
+                counter.visitNode();
+                counter.evaluate();
+
+                const RangeEntry left{entry.begin_, middle, leftChild(entry.node_)};
+                const RangeEntry right{middle + 1, entry.end_, rightChild(entry.node_)};
+                const bool enter_left = overlaps(boxes_[left.node_]);
+                const bool enter_right = right.end_ > right.begin_ && overlaps(boxes_[right.node_]);
+                if (!enter_left)
+                {
+                    counter.prune();
+                }
+                if (!enter_right && right.end_ > right.begin_)
+                {
+                    counter.prune();
+                }
+
+                if (enter_left && enter_right)
+                {
+                    stack[stack_size++] = right;
+                    counter.stackDepth(stack_size);
+                    entry = left;
+                }
+                else if (enter_left)
+                {
+                    entry = left;
+                }
+                else if (enter_right)
+                {
+                    entry = right;
+                }
+                else
+                {
+                    break;
+                }
+            }
+        }
+        this->recordQuery(counter);
+    }
+
+    // Nearest neighbour search that starts from the bound of a hint, and without it if nothing is within
+    std::size_t hintedNearestIndex(const point_t &point, distance_t bound) const
+    {
+        std::size_t best = storage_.size();
+        distance_t best_dist = bound;
+        this->nearestSearch(point, best, best_dist, KDTreeSearchOptions());
+        if (best == storage_.size())
+        {
+            best_dist = std::numeric_limits<distance_t>::max();
+            this->nearestSearch(point, best, best_dist, KDTreeSearchOptions());
+        }
+
+        return storage_.index(best);
+    }
+
+    void nearestSearch(const point_t &point, std::size_t &best, distance_t &best_dist,
+                       const KDTreeSearchOptions &options) const
+    {
+        NearestQuery query{best, best_dist};
+        this->searchTree(point, query, options);
+        best = query.best_;
+        best_dist = query.best_dist_;
+    }
+
+    // Keeps the k closest candidates in a max-heap ordered by distance, so that
+    // the current k-th distance is always at the front and can be used for pruning
+    void knearestSearch(const point_t &point, std::size_t k, std::vector<std::pair<distance_t, std::size_t>> &heap,
+                        const KDTreeSearchOptions &options) const
+    {
+        if (k == 0UL)
+        {
+            return;
+        }
+
+        KNearestQuery query{heap, k};
+        this->searchTree(point, query, options);
+    }
+
+    static void pushToHeap(std::vector<std::pair<distance_t, std::size_t>> &heap, std::size_t k, distance_t dist,
+                           std::size_t slot)
+    {
+        if (heap.size() < k)
+        {
+            heap.emplace_back(dist, slot);
+            std::push_heap(heap.begin(), heap.end(), compareHeapEntries);
+        }
+        else if (dist < heap.front().first)
+        {
+            std::pop_heap(heap.begin(), heap.end(), compareHeapEntries);
+            heap.back() = std::make_pair(dist, slot);
+            std::push_heap(heap.begin(), heap.end(), compareHeapEntries);
+        }
+    }
+
+    static bool compareHeapEntries(const std::pair<distance_t, std::size_t> &lhs,
+                                   const std::pair<distance_t, std::size_t> &rhs)
+    {
+        return lhs.first < rhs.first;
+    }
+
+    void heapToSortedNeighbours(std::vector<std::pair<distance_t, std::size_t>> &heap, std::vector<point_t> &neighbours,
+                                std::vector<double> &distances) const
+    {
+        std::sort_heap(heap.begin(), heap.end(), compareHeapEntries);
+
+        neighbours.clear();
+        distances.clear();
+        neighbours.reserve(heap.size());
+        distances.reserve(heap.size());
+
+        for (const auto &entry : heap)
+        {
+            neighbours.emplace_back(storage_.point(entry.second));
+            distances.emplace_back(entry.first);
+        }
+    }
+
+    void heapToSortedNeighbours(std::vector<std::pair<distance_t, std::size_t>> &heap,
+                                std::vector<neighbour_t> &neighbours) const
+    {
+        std::sort_heap(heap.begin(), heap.end(), compareHeapEntries);
+
+        neighbours.clear();
+        neighbours.reserve(heap.size());
+
+        for (const auto &entry : heap)
+        {
+            neighbours.emplace_back(storage_.index(entry.second), entry.first);
+        }
+    }
+
+    static void sortNeighborsByRadius(std::vector<neighbour_t> &neighbours)
+    {
+        std::sort(neighbours.begin(), neighbours.end(), [](const neighbour_t &lhs, const neighbour_t &rhs) -> bool {
+            return lhs.second < rhs.second;
+        });
+    }
+
+    void sortNeighborsByRadius(std::vector<point_t> &neighbors, std::vector<double> &distances) const
+    {
+        if (neighbors.empty())
+        {
+            return;
+        }
+
+        std::vector<std::size_t> indices;
+        indices.reserve(neighbors.size());
+        for (std::size_t i = 0; i < neighbors.size(); ++i)
+        {
+            indices.emplace_back(i);
+        }
+
+        std::sort(indices.begin(), indices.end(), [&distances](const std::size_t &idx_1, const std::size_t &idx_2) {
+            return (distances[idx_1] < distances[idx_2]);
+        });
+
+        std::vector<point_t> neighbours_temp;
+        neighbours_temp.reserve(neighbors.size());
+
+        std::vector<double> distances_temp;
+        distances_temp.reserve(distances.size());
+
+        for (const std::size_t &index : indices)
+        {
+            neighbours_temp.emplace_back(std::move(neighbors[index]));
+            distances_temp.emplace_back(std::move(distances[index]));
+        }
+
+        neighbors = std::move(neighbours_temp);
+        distances = std::move(distances_temp);
+    }
+
+    // Calls visit(slot, distance) for every point within the search radius, except for the
+    // query point itself
+    template <typename Visitor>
+    void neighbourWithinRadiusSearch(const point_t &point, double search_radius, Visitor &&visit) const
+    {
+        RadiusQuery<Visitor> query{static_cast<distance_t>(metric_.reduce(search_radius)), visit};
+        this->searchTree(point, query);
+    }
+};
+
+// Tree over a point buffer owned by the caller, see the StridedView layout
+template <typename T, std::size_t dim, typename Metric = EuclideanMetric>
+using KDTreeView = KDTree<T, dim, StridedView, Metric>;
+
+// KD-Tree that supports insert and erase by the logarithmic method of Bentley and Saxe. The points are kept
+// in static subtrees, where level i holds at most 2^i points. An insert merges the new points with all
+// occupied levels below the first empty level that is large enough, so every point is rebuilt O(log n) times
+// and an insert costs O(log^2 n) amortized. Erased points stay in their subtree as tombstones, which queries
+// skip, until they are dropped by the next merge of their level or by a compaction of all levels once they
+// make up more than half of the stored points. Points are identified by the id returned from insert.
+template <typename T, std::size_t dim, typename Layout = ArrayOfStructs, typename Metric = EuclideanMetric>
+class DynamicKDTree
+{
+  public:
+    using point_t = std::array<T, dim>;
+
+    using distance_t = typename KDTreeDistance<T>::type;
+
+    // Id of a point together with its distance to the query point, in the reduced form of the metric
+    using neighbour_t = std::pair<std::size_t, double>;
+
+    explicit DynamicKDTree(const KDTreeBuildOptions &options = KDTreeBuildOptions(), const Metric &metric = Metric())
+        : options_(options), metric_(metric)
+    {
+    }
+
+    // Number of points that were inserted and not erased
+    std::size_t size() const
+    {
+        return stored_ - erased_stored_;
+    }
+
+    std::size_t insert(const point_t &point)
+    {
+        return this->insert(std::vector<point_t>{point});
+    }
+
+    // Inserts all points with consecutive ids and returns the id of the first one
+    std::size_t insert(std::vector<point_t> points)
+    {
+        const std::size_t first_id = erased_.size();
+        std::vector<std::size_t> ids(points.size());
+        std::iota(ids.begin(), ids.end(), first_id);
+        erased_.resize(first_id + points.size(), false);
+        stored_ += points.size();
+
+        this->merge(std::move(points), std::move(ids), 0UL);
+        return first_id;
+    }
+
+    // Returns false if the id does not refer to a point in the tree
+    bool erase(std::size_t id)
+    {
+        if (id >= erased_.size() || erased_[id])
+        {
+            return false;
+        }
+
+        erased_[id] = true;
+        ++erased_stored_;
+        if (2UL * erased_stored_ > stored_)
+        {
+            this->compact();
+        }
+        return true;
+    }
+
+    bool contains(std::size_t id) const
+    {
+        return id < erased_.size() && !erased_[id];
+    }
+
+    point_t nearest(const point_t &point) const
+    {
+        const NearestQuery query = this->nearestSearch(point);
+        return query.best_level_->tree_.storage_.point(query.best_slot_);
+    }
+
+    std::size_t nearestIndex(const point_t &point) const
+    {
+        return this->nearestSearch(point).best_;
+    }
+
+    void knearest(const point_t &point, std::size_t k, std::vector<neighbour_t> &neighbours) const
+    {
+        if (this->size() == 0UL)
+        {
+            throw std::logic_error("Tree is empty");
+        }
+
+        // The heap is shared by all levels, so that every level is pruned by the best points found so far
+        std::vector<std::pair<distance_t, std::size_t>> heap;
+        heap.reserve(k + 1);
+        if (k > 0UL)
+        {
+            for (const auto &level : levels_)
+            {
+                if (level)
+                {
+                    KNearestQuery query{&*level, &erased_, heap, k};
+                    level->tree_.searchTree(point, query);
+                }
+            }
+        }
+
+        std::sort_heap(heap.begin(), heap.end(), tree_t::compareHeapEntries);
+        neighbours.clear();
+        neighbours.reserve(heap.size());
+        for (const auto &entry : heap)
+        {
+            neighbours.emplace_back(entry.second, entry.first);
+        }
+    }
+
+    void findNeighborsWithinRadius(const point_t &point, double search_radius, std::vector<neighbour_t> &neighbours,
+                                   bool return_sorted = true) const
+    {
+        if (this->size() == 0UL)
+        {
+            throw std::logic_error("Tree is empty");
+        }
+
+        neighbours.clear();
+        for (const auto &level : levels_)
+        {
+            if (level)
+            {
+                level->tree_.neighbourWithinRadiusSearch(point, search_radius,
+                                                         [&](std::size_t slot, distance_t dist) -> void {
+                                                             const std::size_t id = level->id(slot);
+                                                             if (!erased_[id])
+                                                             {
+                                                                 neighbours.emplace_back(id, dist);
+                                                             }
+                                                         });
+            }
+        }
+
+        if (return_sorted)
+        {
+            tree_t::sortNeighborsByRadius(neighbours);
+        }
+    }
+
+  private:
+    using tree_t = KDTree<T, dim, Layout, Metric>;
+
+    // Static subtree and the id of every point in its input order
+    struct Level
+    {
+        tree_t tree_;
+        std::vector<std::size_t> ids_;
 
-  public:
-    KDTree &operator=(const KDTree &rhs) = delete;
-    KDTree(const KDTree &other) = delete;
+        std::size_t id(std::size_t slot) const
+        {
+            return ids_[tree_.storage_.index(slot)];
+        }
+    };
 
-    explicit KDTree(const typename std::vector<point_t>::iterator &begin,
-                    const typename std::vector<point_t>::iterator &end, bool threaded = true)
-        : nodes_(begin, end), root_(nullptr)
+    struct NearestQuery
     {
-        if (threaded)
+        const Level *level_;
+        const std::vector<bool> *erased_;
+        std::size_t best_;
+        std::size_t best_slot_;
+        const Level *best_level_;
+        distance_t best_dist_;
+
+        void visit(std::size_t slot, distance_t dist)
         {
-            root_ = buildTreeParallel(0UL, nodes_.size(), 0UL, 0U);
+            if (dist < best_dist_ && !(*erased_)[level_->id(slot)])
+            {
+                best_ = level_->id(slot);
+                best_slot_ = slot;
+                best_level_ = level_;
+                best_dist_ = dist;
+            }
         }
-        else
+
+        bool prune(distance_t distance) const
         {
-            root_ = buildTree(0UL, nodes_.size(), 0UL);
+            return distance >= best_dist_;
         }
-    }
+    };
 
-    explicit KDTree(const std::vector<point_t> &points, bool threaded = true)
-        : nodes_(points.begin(), points.end()), root_(nullptr)
+    struct KNearestQuery
     {
-        if (threaded)
+        const Level *level_;
+        const std::vector<bool> *erased_;
+        std::vector<std::pair<distance_t, std::size_t>> &heap_;
+        std::size_t k_;
+
+        void visit(std::size_t slot, distance_t dist)
         {
-            root_ = buildTreeParallel(0UL, nodes_.size(), 0UL, 0U);
+            const std::size_t id = level_->id(slot);
+            if (!(*erased_)[id])
+            {
+                tree_t::pushToHeap(heap_, k_, dist, id);
+            }
         }
-        else
+
+        bool prune(distance_t distance) const
         {
-            root_ = buildTree(0UL, nodes_.size(), 0UL);
+            return heap_.size() == k_ && distance >= heap_.front().first;
         }
-    }
+    };
 
-    ~KDTree()
-    {
-        root_ = nullptr;
-        visited_ = 0UL;
-    }
+    KDTreeBuildOptions options_;
+    Metric metric_;
+    std::vector<std::optional<Level>> levels_;
+    std::vector<bool> erased_;
+    std::size_t stored_ = 0UL;
+    std::size_t erased_stored_ = 0UL;
 
-    point_t nearest(const point_t &point)
+    NearestQuery nearestSearch(const point_t &point) const
     {
-        if (root_ == nullptr)
+        if (this->size() == 0UL)
         {
             throw std::logic_error("Tree is empty");
         }
 
-        Node *best = nullptr;
-        double best_dist = std::numeric_limits<double>::max();
-        this->nearestSearch(root_, point, 0UL, std::ref(best), std::ref(best_dist));
-
-        point_t closest_neighbour = best->point_;
-        best = nullptr;
-
-        return closest_neighbour;
+        NearestQuery query{nullptr, &erased_, 0UL, 0UL, nullptr, std::numeric_limits<distance_t>::max()};
+        for (const auto &level : levels_)
+        {
+            if (level)
+            {
+                query.level_ = &*level;
+                level->tree_.searchTree(point, query);
+            }
+        }
+        return query;
     }
 
-    void nearest(const std::vector<point_t> &points, std::vector<point_t> &neighbours, std::uint8_t thread_num = 4U)
+    // Moves the points of every occupied level, except tombstones, into points and ids
+    void collect(Level &level, std::vector<point_t> &points, std::vector<std::size_t> &ids)
     {
-        if (root_ == nullptr)
+        for (std::size_t slot = 0UL; slot < level.tree_.size(); ++slot)
         {
-            throw std::logic_error("Tree is empty");
+            const std::size_t id = level.id(slot);
+            if (erased_[id])
+            {
+                --stored_;
+                --erased_stored_;
+                continue;
+            }
+            points.push_back(level.tree_.storage_.point(slot));
+            ids.push_back(id);
         }
-        const auto &number_of_points = points.size();
-
-        neighbours.clear();
-        neighbours.resize(number_of_points);
-
-        std::vector<std::size_t> indices;
-        indices.resize(number_of_points);
-        std::iota(indices.begin(), indices.end(), 0UL);
-
-        std::for_each(std::execution::par, indices.begin(), indices.end(), [&](const std::size_t &i) -> void {
-            Node *best = nullptr;
-            double best_dist = std::numeric_limits<double>::max();
-
-            this->nearestSearch(root_, points[i], 0UL, std::ref(best), std::ref(best_dist));
-
-            neighbours[i] = best->point_;
-            best = nullptr;
-        });
     }
 
-    void findNeighborsWithinRadius(const point_t &point, double search_radius, std::vector<point_t> &neighbors,
-                                   std::vector<double> &distances, bool return_sorted = true)
+    // Merges the points with the occupied levels from first_level upwards until they fit into an empty level
+    void merge(std::vector<point_t> &&points, std::vector<std::size_t> &&ids, std::size_t first_level)
     {
-        if (root_ == nullptr)
+        if (points.empty())
         {
-            throw std::logic_error("Tree is empty");
+            return;
         }
 
-        neighbors.clear();
-        distances.clear();
-
-        recursiveNeighbourWithinRadiusSearch(root_, point, search_radius, 0UL, neighbors, distances);
-
-        if (return_sorted && !neighbors.empty())
+        std::size_t level = first_level;
+        for (;; ++level)
         {
-            sortNeighborsByRadius(neighbors, distances);
+            if (level == levels_.size())
+            {
+                levels_.emplace_back();
+            }
+
+            if (levels_[level])
+            {
+                this->collect(*levels_[level], points, ids);
+                levels_[level].reset();
+            }
+            if (!levels_[level] && points.size() <= (1UL << level))
+            {
+                break;
+            }
         }
+
+        // Small levels are rebuilt often and are not worth the thread start up
+        KDTreeBuildOptions options = options_;
+        options.threaded = options_.threaded && points.size() > options_.grain_size;
+        levels_[level].emplace(Level{tree_t(points, options, metric_), std::move(ids)});
     }
 
-    void findNeighborsWithinRadius(const std::vector<point_t> &points, double search_radius,
-                                   std::vector<std::vector<point_t>> &neighbors,
-                                   std::vector<std::vector<double>> &distances, bool return_sorted = true)
+    // Rebuilds all live points into as few levels as the binary representation of their count allows
+    void compact()
     {
-        if (root_ == nullptr)
+        std::vector<point_t> points;
+        std::vector<std::size_t> ids;
+        points.reserve(this->size());
+        ids.reserve(this->size());
+        for (auto &level : levels_)
         {
-            throw std::logic_error("Tree is empty");
+            if (level)
+            {
+                this->collect(*level, points, ids);
+            }
         }
-        else if (points.empty())
+        levels_.clear();
+
+        for (std::size_t level = 0UL; (1UL << level) <= points.size(); ++level)
         {
-            throw std::runtime_error("No points were provided");
+            levels_.emplace_back();
+        }
+        std::size_t begin = 0UL;
+        for (std::size_t level = levels_.size(); level-- > 0UL;)
+        {
+            if ((points.size() >> level) & 1UL)
+            {
+                std::vector<point_t> level_points(points.begin() + begin, points.begin() + begin + (1UL << level));
+                std::vector<std::size_t> level_ids(ids.begin() + begin, ids.begin() + begin + (1UL << level));
+                begin += (1UL << level);
+                this->merge(std::move(level_points), std::move(level_ids), level);
+            }
         }
+    }
+};
 
-        const auto &number_of_points = points.size();
+// KD-Tree over points whose number of dimensions is only known at run time, such as feature descriptors
+// with a configured length. Points are passed as flat coordinate buffers. The tree dispatches to a KDTree
+// specialized for the smallest of KERNEL_DIMENSIONS that holds them, so that one binary serves any
+// dimension up to 128 and the listed ones run exactly as fast as their compile-time tree. Other dimensions
+// are padded with zero coordinates, which leaves the distances of the metric unchanged but costs memory
+// and time of the padding axes. Their tree never cycles through the padding axes, it splits by
+// SplitRule::MaxSpread instead of SplitRule::Cycle. The Metric must not depend on the number of dimensions.
+template <typename T, typename Metric = EuclideanMetric> class RuntimeKDTree
+{
+  public:
+    // Numbers of dimensions with a compile-time specialized tree
+    constexpr static std::array<std::size_t, 8> KERNEL_DIMENSIONS = {2UL, 3UL, 4UL, 8UL, 16UL, 32UL, 64UL, 128UL};
+
+    // Index of a point in the input together with its distance to the query point, in the reduced form of
+    // the metric
+    using neighbour_t = std::pair<std::size_t, double>;
+
+    // Builds the tree over count points of dimension coordinates each, the coordinates of point i starting at
+    // data[i * stride]. The coordinates are copied, the buffer may be released afterwards.
+    explicit RuntimeKDTree(const T *data, std::size_t count, std::size_t dimension, std::size_t stride,
+                           const KDTreeBuildOptions &options = KDTreeBuildOptions(), const Metric &metric = Metric())
+        : dimension_(dimension), tree_(makeTree(data, count, dimension, stride, options, metric))
+    {
+    }
 
-        neighbors.clear();
-        distances.clear();
+    // Builds the tree over the points stored one after another in coordinates
+    explicit RuntimeKDTree(const std::vector<T> &coordinates, std::size_t dimension,
+                           const KDTreeBuildOptions &options = KDTreeBuildOptions(), const Metric &metric = Metric())
+        : RuntimeKDTree(coordinates.data(), pointCount(coordinates, dimension), dimension, dimension, options,
+                        metric)
+    {
+    }
 
-        neighbors.resize(number_of_points);
-        distances.resize(number_of_points);
+    std::size_t dimension() const
+    {
+        return dimension_;
+    }
 
-        std::vector<std::size_t> indices;
-        indices.resize(number_of_points);
-        std::iota(indices.begin(), indices.end(), 0UL);
+    // Number of dimensions of the specialized tree the points are stored in
+    std::size_t kernelDimension() const
+    {
+        return KERNEL_DIMENSIONS[tree_.index()];
+    }
 
-        std::for_each(std::execution::par, indices.begin(), indices.end(), [&](const std::size_t &i) -> void {
-            recursiveNeighbourWithinRadiusSearch(root_, points[i], search_radius, 0UL, neighbors[i], distances[i]);
+    std::size_t size() const
+    {
+        return std::visit([](const auto &tree) -> std::size_t { return tree.size(); }, tree_);
+    }
 
-            if (return_sorted && !neighbors.empty())
-            {
-                sortNeighborsByRadius(neighbors[i], distances[i]);
-            }
-        });
+    // Queries take points of dimension() coordinates
+    std::size_t nearestIndex(const T *point, const KDTreeSearchOptions &options = KDTreeSearchOptions()) const
+    {
+        return std::visit(
+            [&](const auto &tree) -> std::size_t {
+                return tree.nearestIndex(this->paddedPoint(tree, point), options);
+            },
+            tree_);
     }
 
-    void printTree()
+    void knearest(const T *point, std::size_t k, std::vector<neighbour_t> &neighbours,
+                  const KDTreeSearchOptions &options = KDTreeSearchOptions()) const
     {
-        this->printTree("", root_, false);
+        std::visit(
+            [&](const auto &tree) -> void { tree.knearest(this->paddedPoint(tree, point), k, neighbours, options); },
+            tree_);
     }
 
-  private:
-    struct Node
+    void findNeighborsWithinRadius(const T *point, double search_radius, std::vector<neighbour_t> &neighbours,
+                                   bool return_sorted = true) const
     {
-        explicit Node(const point_t &point) : point_(point), left_(nullptr), right_(nullptr){};
-        ~Node()
-        {
-            left_ = nullptr;
-            right_ = nullptr;
-        };
-        point_t point_;
-        Node *left_ = nullptr;
-        Node *right_ = nullptr;
-    };
+        std::visit(
+            [&](const auto &tree) -> void {
+                tree.findNeighborsWithinRadius(this->paddedPoint(tree, point), search_radius, neighbours,
+                                               return_sorted);
+            },
+            tree_);
+    }
+
+    // Batched queries take the query points stored one after another in queries
+    void nearest(const std::vector<T> &queries, std::vector<std::size_t> &neighbour_indices,
+                 const KDTreeSearchOptions &options = KDTreeSearchOptions()) const
+    {
+        std::visit(
+            [&](const auto &tree) -> void {
+                tree.nearest(this->paddedPoints(tree, queries), neighbour_indices, options);
+            },
+            tree_);
+    }
+
+    void knearest(const std::vector<T> &queries, std::size_t k, std::vector<std::vector<neighbour_t>> &neighbours,
+                  const KDTreeSearchOptions &options = KDTreeSearchOptions()) const
+    {
+        std::visit(
+            [&](const auto &tree) -> void {
+                tree.knearest(this->paddedPoints(tree, queries), k, neighbours, options);
+            },
+            tree_);
+    }
+
+  private:
+    template <std::size_t dim> using kernel_t = KDTree<T, dim, ArrayOfStructs, Metric>;
 
-    Node *root_ = nullptr;
-    std::size_t visited_ = 0UL;
-    std::vector<Node> nodes_;
+    using tree_t = std::variant<kernel_t<KERNEL_DIMENSIONS[0]>, kernel_t<KERNEL_DIMENSIONS[1]>,
+                                kernel_t<KERNEL_DIMENSIONS[2]>, kernel_t<KERNEL_DIMENSIONS[3]>,
+                                kernel_t<KERNEL_DIMENSIONS[4]>, kernel_t<KERNEL_DIMENSIONS[5]>,
+                                kernel_t<KERNEL_DIMENSIONS[6]>, kernel_t<KERNEL_DIMENSIONS[7]>>;
 
-    void printTree(const std::string &prefix, const Node *node, bool is_left)
+    static std::size_t pointCount(const std::vector<T> &coordinates, std::size_t dimension)
     {
-        if (node != nullptr)
+        if (dimension == 0UL || coordinates.size() % dimension != 0UL)
         {
-            std::cout << prefix;
+            throw std::invalid_argument("Number of coordinates is not a multiple of the number of dimensions");
+        }
+        return coordinates.size() / dimension;
+    }
 
-            std::cout << (is_left ? "├──" : "└──");
+    // Builds the tree of the first kernel from kernel on that holds dimension coordinates
+    template <std::size_t kernel = 0UL>
+    static tree_t makeTree(const T *data, std::size_t count, std::size_t dimension, std::size_t stride,
+                           const KDTreeBuildOptions &options, const Metric &metric)
+    {
+        constexpr std::size_t dim = KERNEL_DIMENSIONS[kernel];
+        if (dimension == 0UL || dimension > KERNEL_DIMENSIONS.back())
+        {
+            throw std::invalid_argument("Number of dimensions must be between 1 and " +
+                                        std::to_string(KERNEL_DIMENSIONS.back()));
+        }
+        if (stride < dimension)
+        {
+            throw std::invalid_argument("Stride must not be smaller than the number of dimensions");
+        }
 
-            // print the value of the node
-            auto node_it = node->point_.begin();
-            std::cout << "(";
-            for (; node_it != node->point_.end() - 1; ++node_it)
+        if constexpr (kernel + 1UL < KERNEL_DIMENSIONS.size())
+        {
+            if (dimension > dim)
             {
-                std::cout << std::setprecision(2) << std::scientific << *node_it << " ";
+                return makeTree<kernel + 1UL>(data, count, dimension, stride, options, metric);
             }
-            std::cout << std::setprecision(2) << std::scientific << *node_it << ")" << std::endl;
+        }
 
-            // enter the next tree level - left and right branch
-            this->printTree(prefix + (is_left ? "│   " : "    "), node->left_, true);
-            this->printTree(prefix + (is_left ? "│   " : "    "), node->right_, false);
+        // The kernel stores the points as one buffer of coordinates with a stride of dim
+        static_assert(sizeof(std::array<T, dim>) == dim * sizeof(T), "Points must be stored without padding");
+        std::vector<std::array<T, dim>> points(count);
+        for (std::size_t i = 0UL; i < count; ++i)
+        {
+            std::copy(data + i * stride, data + i * stride + dimension, points[i].begin());
+        }
+
+        KDTreeBuildOptions kernel_options = options;
+        if (dimension < dim && kernel_options.split_rule == SplitRule::Cycle)
+        {
+            kernel_options.split_rule = SplitRule::MaxSpread;
         }
+        return tree_t(std::in_place_index<kernel>, points, kernel_options, metric);
     }
 
-    Node *buildTree(std::size_t begin, std::size_t end, std::size_t index)
+    template <std::size_t dim> std::array<T, dim> paddedPoint(const kernel_t<dim> &, const T *point) const
     {
-        if (end <= begin)
+        std::array<T, dim> padded{};
+        std::copy(point, point + dimension_, padded.begin());
+        return padded;
+    }
+
+    template <std::size_t dim>
+    std::vector<std::array<T, dim>> paddedPoints(const kernel_t<dim> &tree, const std::vector<T> &queries) const
+    {
+        const std::size_t count = pointCount(queries, dimension_);
+        std::vector<std::array<T, dim>> points;
+        points.reserve(count);
+        for (std::size_t i = 0UL; i < count; ++i)
         {
-            return nullptr;
+            points.push_back(this->paddedPoint(tree, queries.data() + i * dimension_));
         }
+        return points;
+    }
 
-        std::size_t middle = begin + (end - begin) / 2;
-        auto nodes_it = nodes_.begin();
-        std::nth_element(
-            nodes_it + begin, nodes_it + middle, nodes_it + end,
-            [&index](const Node &pt_1, const Node &pt_2) -> bool { return pt_1.point_[index] < pt_2.point_[index]; });
+    std::size_t dimension_;
+    tree_t tree_;
+};
 
-        index = (index + 1) % dim;
-        nodes_[middle].left_ = this->buildTree(begin, middle, index);
-        nodes_[middle].right_ = this->buildTree(middle + 1, end, index);
+// Randomized KD forest for approximate nearest neighbour search in many dimensions, where a single tree has to
+// visit almost all of its leaves to prove a result. Every tree splits on one of the axes with the largest
+// variance drawn at random, see SplitRule::RandomizedVariance, so the trees partition the points differently.
+// The trees only hold permutations of a point buffer shared by all of them. A query descends every tree to the
+// leaf bucket containing the query point and keeps the far branches of all trees in one priority queue, from
+// which the closest branch of any tree is explored next (best-bin-first). The max_leaves option of the search
+// is the budget of leaf buckets scanned over all trees, 0 searches until the result is exact.
+template <typename T, std::size_t dim, typename Metric = EuclideanMetric> class KDForest
+{
+  public:
+    using point_t = std::array<T, dim>;
 
-        return &nodes_[middle];
-    }
+    using distance_t = typename KDTreeDistance<T>::type;
 
-    Node *buildTreeParallel(std::size_t begin, std::size_t end, std::size_t index, std::uint8_t recursion_depth = 0U)
+    // Index of a point in the input together with its distance to the query point, in the reduced form of
+    // the metric
+    using neighbour_t = std::pair<std::size_t, double>;
+
+    // Builds tree_count trees, tree i with the seed options.seed + i. The split rule of the options is replaced
+    // by SplitRule::RandomizedVariance. A threaded build builds the trees concurrently.
+    explicit KDForest(std::vector<point_t> points, std::size_t tree_count = DEFAULT_FOREST_SIZE,
+                      const KDTreeBuildOptions &options = KDTreeBuildOptions(), const Metric &metric = Metric())
+        : points_(std::move(points))
     {
-        // sequential
-        if (recursion_depth > DEFAULT_RECURSION_DEPTH)
+        if (tree_count == 0UL)
         {
-            return buildTree(begin, end, index);
+            throw std::invalid_argument("A forest needs at least one tree");
         }
-        // parallel
-        else
-        {
-            if (end <= begin)
-            {
-                return nullptr;
-            }
 
-            std::size_t middle = begin + (end - begin) / 2;
-            auto nodes_it = nodes_.begin();
-            std::nth_element(nodes_it + begin, nodes_it + middle, nodes_it + end,
-                             [&index](const Node &pt_1, const Node &pt_2) -> bool {
-                                 return pt_1.point_[index] < pt_2.point_[index];
-                             });
+        // The trees read points_ as one buffer of coordinates with a stride of dim
+        static_assert(sizeof(point_t) == dim * sizeof(T), "Points must be stored without padding");
+        const T *data = points_.empty() ? nullptr : points_.front().data();
+        std::vector<std::future<tree_t>> trees;
+        for (std::size_t i = 0UL; i < tree_count; ++i)
+        {
+            KDTreeBuildOptions tree_options = options;
+            tree_options.split_rule = SplitRule::RandomizedVariance;
+            tree_options.seed = options.seed + i;
+            trees.push_back(std::async(options.threaded ? std::launch::async : std::launch::deferred,
+                                       [this, data, tree_options, &metric]() -> tree_t {
+                                           return tree_t(data, points_.size(), dim, tree_options, metric);
+                                       }));
+        }
+        trees_.reserve(tree_count);
+        for (auto &tree : trees)
+        {
+            trees_.push_back(tree.get());
+        }
+    }
 
-            index = (index + 1) % dim;
+    // The trees refer to the point buffer of the forest, which a move keeps but a copy would not
+    KDForest(const KDForest &other) = delete;
+    KDForest(KDForest &&other) noexcept = default;
+    KDForest &operator=(const KDForest &rhs) = delete;
+    KDForest &operator=(KDForest &&rhs) noexcept = default;
 
-            std::future<Node *> future = std::async(std::launch::async, [&]() {
-                return this->buildTreeParallel(begin, middle, index, recursion_depth + 1);
-            });
+    std::size_t size() const
+    {
+        return points_.size();
+    }
 
-            nodes_[middle].right_ = this->buildTreeParallel(middle + 1, end, index, recursion_depth + 1);
-            nodes_[middle].left_ = future.get();
+    std::size_t treeCount() const
+    {
+        return trees_.size();
+    }
 
-            return &nodes_[middle];
-        }
+    const point_t &point(std::size_t index) const
+    {
+        return points_[index];
     }
 
-    double distanceSquared(const point_t &pt_1, const point_t &pt_2) const
+    std::size_t nearestIndex(const point_t &point, const KDTreeSearchOptions &options = KDTreeSearchOptions()) const
     {
-        double dist = 0.0;
-        for (std::size_t i = 0; i < dim; ++i)
+        if (points_.empty())
         {
-            double delta = pt_1[i] - pt_2[i];
-            dist += delta * delta;
+            throw std::logic_error("Forest is empty");
         }
-        return dist;
+
+        NearestQuery query{nullptr, points_.size(), std::numeric_limits<distance_t>::max()};
+        this->searchForest(point, query, options);
+        return query.best_;
     }
 
-    void nearestSearch(Node *root, const point_t &point, std::size_t index, Node *&best, double &best_dist)
+    void knearest(const point_t &point, std::size_t k, std::vector<neighbour_t> &neighbours,
+                  const KDTreeSearchOptions &options = KDTreeSearchOptions()) const
     {
-        if (root == nullptr)
+        if (points_.empty())
         {
-            return;
+            throw std::logic_error("Forest is empty");
         }
 
-        double dist = this->distanceSquared(root->point_, point);
-        if ((best == nullptr) || (dist < best_dist))
+        std::vector<std::pair<distance_t, std::size_t>> heap;
+        heap.reserve(k + 1);
+        KNearestQuery query{nullptr, heap, k};
+        this->searchForest(point, query, options);
+
+        std::sort_heap(heap.begin(), heap.end(), tree_t::compareHeapEntries);
+        neighbours.clear();
+        neighbours.reserve(heap.size());
+        for (const auto &entry : heap)
         {
-            best_dist = dist;
-            best = root;
+            neighbours.emplace_back(entry.second, entry.first);
         }
+    }
 
-        if (best_dist == 0.0)
+    void nearest(const std::vector<point_t> &points, std::vector<std::size_t> &neighbour_indices,
+                 const KDTreeSearchOptions &options = KDTreeSearchOptions()) const
+    {
+        if (points_.empty())
         {
-            return;
+            throw std::logic_error("Forest is empty");
         }
 
-        double delta = root->point_[index] - point[index];
-        index = (index + 1) % dim;
-        this->nearestSearch((delta > 0.0) ? root->left_ : root->right_, point, index, best, best_dist);
+        neighbour_indices.resize(points.size());
+        std::vector<std::size_t> order(points.size());
+        std::iota(order.begin(), order.end(), 0UL);
+        std::for_each(std::execution::par, order.begin(), order.end(), [&](const std::size_t &i) -> void {
+            neighbour_indices[i] = this->nearestIndex(points[i], options);
+        });
+    }
 
-        if (delta * delta >= best_dist)
+    void knearest(const std::vector<point_t> &points, std::size_t k, std::vector<std::vector<neighbour_t>> &neighbours,
+                  const KDTreeSearchOptions &options = KDTreeSearchOptions()) const
+    {
+        if (points_.empty())
         {
-            return;
+            throw std::logic_error("Forest is empty");
         }
 
-        this->nearestSearch((delta > 0.0) ? root->right_ : root->left_, point, index, best, best_dist);
+        neighbours.resize(points.size());
+        std::vector<std::size_t> order(points.size());
+        std::iota(order.begin(), order.end(), 0UL);
+        std::for_each(std::execution::par, order.begin(), order.end(), [&](const std::size_t &i) -> void {
+            this->knearest(points[i], k, neighbours[i], options);
+        });
     }
 
-    void sortNeighborsByRadius(std::vector<point_t> &neighbors, std::vector<double> &distances)
+  private:
+    using tree_t = KDTree<T, dim, StridedView, Metric>;
+
+    // Subtree of one of the trees waiting in the priority queue, with the lower bound on its distance
+    struct Branch
     {
-        if (neighbors.empty())
+        distance_t distance_;
+        std::size_t tree_;
+        std::size_t begin_;
+        std::size_t end_;
+        std::size_t node_;
+    };
+
+    // Every point is found once per tree, the queries only count it once
+    struct NearestQuery
+    {
+        const tree_t *tree_;
+        std::size_t best_;
+        distance_t best_dist_;
+
+        void visit(std::size_t slot, distance_t dist)
         {
-            return;
+            if (dist < best_dist_)
+            {
+                best_ = tree_->storage_.index(slot);
+                best_dist_ = dist;
+            }
         }
 
-        std::vector<std::size_t> indices;
-        indices.reserve(neighbors.size());
-        for (std::size_t i = 0; i < neighbors.size(); ++i)
+        bool prune(distance_t distance) const
         {
-            indices.emplace_back(i);
+            return distance >= best_dist_;
         }
+    };
 
-        std::sort(indices.begin(), indices.end(), [&distances](const std::size_t &idx_1, const std::size_t &idx_2) {
-            return (distances[idx_1] < distances[idx_2]);
-        });
-
-        std::vector<point_t> neighbours_temp;
-        neighbours_temp.reserve(neighbors.size());
+    struct KNearestQuery
+    {
+        const tree_t *tree_;
+        std::vector<std::pair<distance_t, std::size_t>> &heap_;
+        std::size_t k_;
 
-        std::vector<double> distances_temp;
-        distances_temp.reserve(distances.size());
+        void visit(std::size_t slot, distance_t dist)
+        {
+            if (heap_.size() == k_ && dist >= heap_.front().first)
+            {
+                return;
+            }
+            const std::size_t index = tree_->storage_.index(slot);
+            for (const auto &entry : heap_)
+            {
+                if (entry.second == index)
+                {
+                    return;
+                }
+            }
+            tree_t::pushToHeap(heap_, k_, dist, index);
+        }
 
-        for (const std::size_t &index : indices)
+        bool prune(distance_t distance) const
         {
-            neighbours_temp.emplace_back(std::move(neighbors[index]));
-            distances_temp.emplace_back(std::move(distances[index]));
+            return heap_.size() == k_ && distance >= heap_.front().first;
         }
+    };
 
-        neighbors = std::move(neighbours_temp);
-        distances = std::move(distances_temp);
+    static bool fartherBranch(const Branch &lhs, const Branch &rhs)
+    {
+        return lhs.distance_ > rhs.distance_;
     }
 
-    void recursiveNeighbourWithinRadiusSearch(Node *root, const point_t &point, double search_radius, std::size_t index,
-                                              std::vector<point_t> &neighbours, std::vector<double> &distances)
+    // Best-bin-first search over all trees. Like KDTree::searchTree it evaluates the splitting points on the
+    // way down and scales the lower bounds of approximate searches by (1 + epsilon)^2, but the far children
+    // go into a priority queue shared by the trees instead of a stack per tree.
+    template <typename Query>
+    void searchForest(const point_t &point, Query &query, const KDTreeSearchOptions &options) const
     {
-        if (root == nullptr)
-        {
-            return;
-        }
-
-        double dist = this->distanceSquared(root->point_, point);
+        const bool approximate = options.epsilon > 0.0;
+        const double scale = trees_.front().metric_.reduce(1.0 + options.epsilon);
+        std::vector<Branch> queue;
+        std::size_t leaves = 0UL;
+
+        // Descends from a branch to the leaf bucket on the side of the query point and queues the far children
+        // on the way. Returns false once the budget of leaf buckets is used up.
+        auto descend = [&](Branch branch) -> bool {
+            const tree_t &tree = trees_[branch.tree_];
+            query.tree_ = &tree;
+            while (branch.end_ > branch.begin_)
+            {
+                if (tree.isLeaf(branch.begin_, branch.end_))
+                {
+                    tree.scanLeaf(branch.begin_, branch.end_, point,
+                                  [&query](std::size_t slot, distance_t dist) -> void { query.visit(slot, dist); });
+                    return ++leaves != options.max_leaves;
+                }
+
+                const std::size_t middle = branch.begin_ + (branch.end_ - branch.begin_) / 2;
+                const std::size_t axis = tree.axes_[branch.node_];
+                const distance_t coordinate = static_cast<distance_t>(point[axis]);
+                const distance_t split = static_cast<distance_t>(tree.storage_.coordinate(middle, axis));
+
+                query.visit(middle, tree.storage_.distance(middle, point, tree.metric_));
+                if (query.prune(branch.distance_))
+                {
+                    break;
+                }
+
+                distance_t plane_distance = tree.metric_.splitDistance(coordinate, split, axis);
+                if (approximate)
+                {
+                    plane_distance = static_cast<distance_t>(plane_distance * scale);
+                }
+                const distance_t far_distance = std::max(branch.distance_, plane_distance);
+                // The query point lies left of the split, so the right child is the far one
+                const bool query_left = split > coordinate;
+                if (!query.prune(far_distance))
+                {
+                    queue.push_back(query_left ? Branch{far_distance, branch.tree_, middle + 1, branch.end_,
+                                                   tree_t::rightChild(branch.node_)}
+                                          : Branch{far_distance, branch.tree_, branch.begin_, middle,
+                                                   tree_t::leftChild(branch.node_)});
+                    std::push_heap(queue.begin(), queue.end(), fartherBranch);
+                }
+
+                if (query_left)
+                {
+                    branch.end_ = middle;
+                    branch.node_ = tree_t::leftChild(branch.node_);
+                }
+                else
+                {
+                    branch.begin_ = middle + 1;
+                    branch.node_ = tree_t::rightChild(branch.node_);
+                }
+            }
+            return true;
+        };
 
-        if (dist <= search_radius * search_radius && dist != 0.0)
+        for (std::size_t i = 0UL; i < trees_.size(); ++i)
         {
-            neighbours.emplace_back(root->point_);
-            distances.emplace_back(dist);
+            if (!descend(Branch{distance_t(0), i, 0UL, points_.size(), 0UL}))
+            {
+                return;
+            }
         }
 
-        bool left_subtree = (point[index] - search_radius < root->point_[index]);
-        bool right_subtree = (point[index] + search_radius > root->point_[index]);
+        while (!queue.empty())
+        {
+            std::pop_heap(queue.begin(), queue.end(), fartherBranch);
+            Branch branch = queue.back();
+            queue.pop_back();
 
-        index = (index + 1) % dim;
+            // Every other queued branch is at least as far away
+            if (query.prune(branch.distance_))
+            {
+                return;
+            }
 
-        // If the distance between the target point and the split plane
-        // of the current node is less than the search radius,
-        // search both the left and right sub-trees.
+            const tree_t &tree = trees_[branch.tree_];
+            if (!tree.isLeaf(branch.begin_, branch.end_))
+            {
+                distance_t box_distance = tree.boxDistance(point, tree.boxes_[branch.node_]);
+                if (approximate)
+                {
+                    box_distance = static_cast<distance_t>(box_distance * scale);
+                }
+                branch.distance_ = std::max(branch.distance_, box_distance);
+                if (query.prune(branch.distance_))
+                {
+                    continue;
+                }
+            }
 
-        if (left_subtree)
-        {
-            recursiveNeighbourWithinRadiusSearch(root->left_, point, search_radius, index, neighbours, distances);
+            if (!descend(branch))
+            {
+                return;
+            }
         }
-        if (right_subtree)
+    }
+
+    std::vector<point_t> points_;
+    std::vector<tree_t> trees_;
+};
+
+// Attaches a user payload to every point of a tree. Payloads are kept in input order, so the indices
+// returned by the queries of Tree look them up directly and only integers are copied while searching.
+template <typename Tree, typename Payload> class KDTreeWithPayload : public Tree
+{
+  public:
+    template <typename... Args>
+    explicit KDTreeWithPayload(std::vector<Payload> payloads, Args &&...args)
+        : Tree(std::forward<Args>(args)...), payloads_(std::move(payloads))
+    {
+        if (payloads_.size() != Tree::size())
         {
-            recursiveNeighbourWithinRadiusSearch(root->right_, point, search_radius, index, neighbours, distances);
+            throw std::invalid_argument("Number of payloads does not match the number of points");
         }
     }
+
+    const Payload &payload(std::size_t index) const
+    {
+        return payloads_[index];
+    }
+
+    const Payload &nearestPayload(const typename Tree::point_t &point) const
+    {
+        return payloads_[Tree::nearestIndex(point)];
+    }
+
+  private:
+    std::vector<Payload> payloads_;
 };
 
 #endif // KDTREE_HPP_
@@ -1,9 +1,76 @@
+#include "clustering.hpp"
 #include "kdtree.hpp"
 
 #include <chrono>
+#include <cstdint>
 #include <cstdio>
 #include <random>
-#include <thread>
+#include <string>
+#include <type_traits>
+
+// Measures construction and query times of a KD-Tree using the given coordinate storage layout
+template <typename Layout, std::size_t NUM_DIM>
+void benchmarkLayout(const std::string &name, const std::vector<point_t<double, NUM_DIM>> &points,
+                     const std::vector<point_t<double, NUM_DIM>> &points_of_interest)
+{
+    auto t1 = std::chrono::high_resolution_clock::now();
+    KDTree<double, NUM_DIM, Layout> kdtree(points);
+    auto t2 = std::chrono::high_resolution_clock::now();
+
+    std::vector<point_t<double, NUM_DIM>> neighbour_points;
+    auto t3 = std::chrono::high_resolution_clock::now();
+    kdtree.nearest(points_of_interest, neighbour_points);
+    auto t4 = std::chrono::high_resolution_clock::now();
+
+    std::vector<point_t<double, NUM_DIM>> neighbours;
+    std::vector<double> distances;
+    auto t5 = std::chrono::high_resolution_clock::now();
+    for (std::size_t i = 0UL; i < 1'000UL && i < points_of_interest.size(); ++i)
+    {
+        kdtree.findNeighborsWithinRadius(points_of_interest[i], 0.5, neighbours, distances, false);
+    }
+    auto t6 = std::chrono::high_resolution_clock::now();
+
+    std::cout << name << " construction: "
+              << std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count() / 1.0e9
+              << ", nearest neighbour search (many-to-many): "
+              << std::chrono::duration_cast<std::chrono::nanoseconds>(t4 - t3).count() / 1.0e9
+              << ", radius neighbour search (1000 queries): "
+              << std::chrono::duration_cast<std::chrono::nanoseconds>(t6 - t5).count() / 1.0e9 << std::endl;
+}
+
+// Measures nearest neighbour queries of a KD-Tree over the points converted to coordinates of type T
+template <typename T, std::size_t NUM_DIM>
+void benchmarkCoordinateType(const std::string &name, const std::vector<point_t<double, NUM_DIM>> &points,
+                             const std::vector<point_t<double, NUM_DIM>> &points_of_interest)
+{
+    // Integer coordinates keep a resolution of 1e-3
+    const double scale = std::is_integral_v<T> ? 1'000.0 : 1.0;
+    auto convert = [scale](const std::vector<point_t<double, NUM_DIM>> &input) -> std::vector<point_t<T, NUM_DIM>> {
+        std::vector<point_t<T, NUM_DIM>> output;
+        output.reserve(input.size());
+        for (const auto &point : input)
+        {
+            point_t<T, NUM_DIM> converted;
+            for (std::size_t axis = 0UL; axis < NUM_DIM; ++axis)
+            {
+                converted[axis] = static_cast<T>(point[axis] * scale);
+            }
+            output.push_back(converted);
+        }
+        return output;
+    };
+
+    KDTree<T, NUM_DIM> kdtree(convert(points));
+    const std::vector<point_t<T, NUM_DIM>> converted_points_of_interest = convert(points_of_interest);
+
+    std::vector<std::size_t> neighbour_indices;
+    auto t1 = std::chrono::high_resolution_clock::now();
+    kdtree.nearest(converted_points_of_interest, neighbour_indices);
+    auto t2 = std::chrono::high_resolution_clock::now();
+    std::cout << name << " nearest neighbour search (many-to-many): "
+              << std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count() / 1.0e9 << std::endl;
+}
 
 int main()
 {
@@ -100,16 +167,502 @@ int main()
             }
 
             std::vector<point_t<double, NUM_DIM>> neighbour_points;
-            std::size_t number_of_threads = std::thread::hardware_concurrency();
 
             // Search closest point
             auto t3 = std::chrono::high_resolution_clock::now();
-            kdtree.nearest(points_of_interest, neighbour_points, number_of_threads);
+            kdtree.nearest(points_of_interest, neighbour_points);
             auto t4 = std::chrono::high_resolution_clock::now();
             std::cout << "Time elapsed for nearest neighbour search (many-to-many): "
                       << std::chrono::duration_cast<std::chrono::nanoseconds>(t4 - t3).count() / 1.0e9 << std::endl
                       << std::endl;
         }
+        // Approximate nearest neighbour search, trading recall for speed
+        {
+            KDTree<double, NUM_DIM> kdtree(points);
+
+            std::vector<point_t<double, NUM_DIM>> points_of_interest;
+            for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+            {
+                points_of_interest.push_back({dist(gen), dist(gen), dist(gen)});
+            }
+
+            std::vector<std::size_t> exact;
+            kdtree.nearest(points_of_interest, exact);
+
+            for (const auto &[epsilon, max_leaves] : std::vector<std::pair<double, std::size_t>>{
+                     {0.0, 0UL}, {0.5, 0UL}, {1.0, 0UL}, {2.0, 0UL}, {0.0, 1UL}, {0.0, 4UL}})
+            {
+                KDTreeSearchOptions options;
+                options.epsilon = epsilon;
+                options.max_leaves = max_leaves;
+
+                std::vector<std::size_t> approximate;
+                auto t3 = std::chrono::high_resolution_clock::now();
+                kdtree.nearest(points_of_interest, approximate, options);
+                auto t4 = std::chrono::high_resolution_clock::now();
+
+                std::size_t hits = 0UL;
+                for (std::size_t i = 0UL; i < exact.size(); ++i)
+                {
+                    hits += (exact[i] == approximate[i]) ? 1UL : 0UL;
+                }
+                std::cout << "Approximate search with epsilon " << epsilon << " and max leaves " << max_leaves
+                          << ": " << std::chrono::duration_cast<std::chrono::nanoseconds>(t4 - t3).count() / 1.0e9
+                          << ", recall " << static_cast<double>(hits) / exact.size() << std::endl;
+            }
+            std::cout << std::endl;
+        }
+        // Nearest neighbours of every point of the tree, by a self-join against independent queries
+        {
+            KDTree<double, NUM_DIM> kdtree(points);
+
+            for (const std::size_t k : {1UL, 8UL})
+            {
+                std::vector<std::vector<KDTree<double, NUM_DIM>::neighbour_t>> neighbours;
+                auto t1 = std::chrono::high_resolution_clock::now();
+                kdtree.allNearestNeighbours(k, neighbours);
+                auto t2 = std::chrono::high_resolution_clock::now();
+
+                // Every point finds itself first
+                auto t3 = std::chrono::high_resolution_clock::now();
+                kdtree.knearest(points, k + 1UL, neighbours);
+                auto t4 = std::chrono::high_resolution_clock::now();
+                std::cout << "All " << k << " nearest neighbours of " << NUM_PTS << " points, self-join: "
+                          << std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count() / 1.0e9
+                          << ", independent queries: "
+                          << std::chrono::duration_cast<std::chrono::nanoseconds>(t4 - t3).count() / 1.0e9 << std::endl;
+            }
+            std::cout << std::endl;
+        }
+        // Frame to frame tracking, every point moved a little since the previous frame
+        {
+            KDTree<double, NUM_DIM> kdtree(points);
+
+            std::normal_distribution<double> jitter(0.0, 0.01);
+            std::vector<point_t<double, NUM_DIM>> moved_points;
+            moved_points.reserve(NUM_PTS);
+            for (const auto &point : points)
+            {
+                moved_points.push_back({point[0] + jitter(gen), point[1] + jitter(gen), point[2] + jitter(gen)});
+            }
+
+            std::size_t plain_sum = 0UL;
+            auto t1 = std::chrono::high_resolution_clock::now();
+            for (const auto &point : moved_points)
+            {
+                plain_sum += kdtree.nearestIndex(point);
+            }
+            auto t2 = std::chrono::high_resolution_clock::now();
+
+            // The match of the previous frame is the hint
+            std::size_t hinted_sum = 0UL;
+            auto t3 = std::chrono::high_resolution_clock::now();
+            for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+            {
+                hinted_sum += kdtree.nearestIndex(moved_points[i], points[i]);
+            }
+            auto t4 = std::chrono::high_resolution_clock::now();
+
+            std::vector<std::size_t> indices;
+            std::vector<double> distances;
+            auto t5 = std::chrono::high_resolution_clock::now();
+            kdtree.correspondences(moved_points, 0.05, indices, distances);
+            auto t6 = std::chrono::high_resolution_clock::now();
+            const std::size_t matched = static_cast<std::size_t>(
+                std::count_if(indices.begin(), indices.end(), [](std::size_t i) { return i != KDTREE_NO_NEIGHBOUR; }));
+
+            std::cout << "Tracking " << NUM_PTS << " points, plain: "
+                      << std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count() / 1.0e9
+                      << ", hinted: " << std::chrono::duration_cast<std::chrono::nanoseconds>(t4 - t3).count() / 1.0e9
+                      << (plain_sum == hinted_sum ? "" : " (results differ)") << ", correspondences within 0.05: "
+                      << std::chrono::duration_cast<std::chrono::nanoseconds>(t6 - t5).count() / 1.0e9 << " ("
+                      << matched << " matched)" << std::endl
+                      << std::endl;
+        }
+        // Dimension known only at run time, on a specialized kernel and padded to the next one
+        {
+            constexpr std::size_t DESCRIPTOR_POINTS = 100'000UL;
+            constexpr std::size_t DESCRIPTOR_QUERIES = 1'000UL;
+            constexpr std::size_t KERNEL_DIM = 16UL;
+
+            std::vector<point_t<double, KERNEL_DIM>> descriptors(DESCRIPTOR_POINTS);
+            std::vector<point_t<double, KERNEL_DIM>> descriptor_queries(DESCRIPTOR_QUERIES);
+            for (auto &descriptor : descriptors)
+            {
+                std::generate(descriptor.begin(), descriptor.end(), [&]() { return dist(gen); });
+            }
+            for (auto &descriptor : descriptor_queries)
+            {
+                std::generate(descriptor.begin(), descriptor.end(), [&]() { return dist(gen); });
+            }
+            const std::vector<double> flat(descriptors.front().data(),
+                                           descriptors.front().data() + DESCRIPTOR_POINTS * KERNEL_DIM);
+            const std::vector<double> flat_queries(descriptor_queries.front().data(),
+                                                   descriptor_queries.front().data() + DESCRIPTOR_QUERIES * KERNEL_DIM);
+
+            KDTree<double, KERNEL_DIM> kdtree(descriptors);
+            std::vector<std::size_t> indices;
+            auto t1 = std::chrono::high_resolution_clock::now();
+            kdtree.nearest(descriptor_queries, indices, KDTreeSearchOptions());
+            auto t2 = std::chrono::high_resolution_clock::now();
+            std::cout << "Nearest neighbours of " << DESCRIPTOR_QUERIES << " queries in " << KERNEL_DIM
+                      << " dimensions, compile-time: "
+                      << std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count() / 1.0e9;
+
+            // The same points with 12 dimensions run on the padded 16 dimensional kernel
+            for (const std::size_t dimension : {KERNEL_DIM, 12UL})
+            {
+                RuntimeKDTree<double> runtime_tree(flat.data(), DESCRIPTOR_POINTS, dimension, KERNEL_DIM);
+                std::vector<double> queries;
+                for (std::size_t i = 0UL; i < DESCRIPTOR_QUERIES; ++i)
+                {
+                    queries.insert(queries.end(), flat_queries.begin() + i * KERNEL_DIM,
+                                   flat_queries.begin() + i * KERNEL_DIM + dimension);
+                }
+
+                auto t3 = std::chrono::high_resolution_clock::now();
+                runtime_tree.nearest(queries, indices);
+                auto t4 = std::chrono::high_resolution_clock::now();
+                std::cout << ", run-time " << dimension << ": "
+                          << std::chrono::duration_cast<std::chrono::nanoseconds>(t4 - t3).count() / 1.0e9;
+            }
+            std::cout << std::endl << std::endl;
+        }
+        // Approximate search in many dimensions, an exact tree against a randomized forest with a budget
+        {
+            constexpr std::size_t DESCRIPTOR_POINTS = 100'000UL;
+            constexpr std::size_t DESCRIPTOR_QUERIES = 1'000UL;
+            constexpr std::size_t DESCRIPTOR_DIM = 64UL;
+
+            // Descriptors gather around a few thousand distinct features, the queries are noisy copies
+            std::normal_distribution<double> noise(0.0, 1.0);
+            std::vector<point_t<double, DESCRIPTOR_DIM>> features(2'000UL);
+            for (auto &feature : features)
+            {
+                std::generate(feature.begin(), feature.end(), [&]() { return dist(gen); });
+            }
+            auto noisy = [&](point_t<double, DESCRIPTOR_DIM> point) -> point_t<double, DESCRIPTOR_DIM> {
+                for (auto &coordinate : point)
+                {
+                    coordinate += noise(gen);
+                }
+                return point;
+            };
+            std::vector<point_t<double, DESCRIPTOR_DIM>> descriptors;
+            for (std::size_t i = 0UL; i < DESCRIPTOR_POINTS; ++i)
+            {
+                descriptors.push_back(noisy(features[i % features.size()]));
+            }
+            std::vector<point_t<double, DESCRIPTOR_DIM>> descriptor_queries;
+            for (std::size_t i = 0UL; i < DESCRIPTOR_QUERIES; ++i)
+            {
+                descriptor_queries.push_back(noisy(descriptors[(i * 7919UL) % DESCRIPTOR_POINTS]));
+            }
+
+            KDTree<double, DESCRIPTOR_DIM> kdtree(descriptors);
+            std::vector<std::size_t> exact;
+            auto t1 = std::chrono::high_resolution_clock::now();
+            kdtree.nearest(descriptor_queries, exact, KDTreeSearchOptions());
+            auto t2 = std::chrono::high_resolution_clock::now();
+            std::cout << "Nearest neighbours of " << DESCRIPTOR_QUERIES << " queries in " << DESCRIPTOR_DIM
+                      << " dimensions, exact tree: "
+                      << std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count() / 1.0e9 << std::endl;
+
+            // The same budget of leaf buckets for the single tree and for the forest
+            KDForest<double, DESCRIPTOR_DIM> forest(descriptors);
+            for (const std::size_t max_leaves : {8UL, 32UL, 128UL})
+            {
+                KDTreeSearchOptions options;
+                options.max_leaves = max_leaves;
+                std::vector<std::size_t> tree_result;
+                std::vector<std::size_t> forest_result;
+                auto t3 = std::chrono::high_resolution_clock::now();
+                kdtree.nearest(descriptor_queries, tree_result, options);
+                auto t4 = std::chrono::high_resolution_clock::now();
+                forest.nearest(descriptor_queries, forest_result, options);
+                auto t5 = std::chrono::high_resolution_clock::now();
+
+                std::size_t tree_hits = 0UL;
+                std::size_t forest_hits = 0UL;
+                for (std::size_t i = 0UL; i < exact.size(); ++i)
+                {
+                    tree_hits += (exact[i] == tree_result[i]) ? 1UL : 0UL;
+                    forest_hits += (exact[i] == forest_result[i]) ? 1UL : 0UL;
+                }
+                std::cout << "Max leaves " << max_leaves << ", single tree: "
+                          << std::chrono::duration_cast<std::chrono::nanoseconds>(t4 - t3).count() / 1.0e9
+                          << ", recall " << static_cast<double>(tree_hits) / exact.size() << ", forest of "
+                          << forest.treeCount() << " trees: "
+                          << std::chrono::duration_cast<std::chrono::nanoseconds>(t5 - t4).count() / 1.0e9
+                          << ", recall " << static_cast<double>(forest_hits) / exact.size() << std::endl;
+            }
+            std::cout << std::endl;
+        }
+        // Euclidean clustering, per point radius searches merged by the caller against the library
+        {
+            KDTree<double, NUM_DIM> kdtree(points);
+            constexpr double CLUSTER_RADIUS = 0.15;
+
+            // Every search materializes its neighbours, which a sequential union-find merges
+            auto t1 = std::chrono::high_resolution_clock::now();
+            std::vector<std::size_t> parents(NUM_PTS);
+            std::iota(parents.begin(), parents.end(), 0UL);
+            auto find = [&parents](std::size_t i) -> std::size_t {
+                while (parents[i] != i)
+                {
+                    parents[i] = parents[parents[i]];
+                    i = parents[i];
+                }
+                return i;
+            };
+            std::vector<KDTree<double, NUM_DIM>::neighbour_t> neighbours;
+            for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+            {
+                kdtree.findNeighborsWithinRadius(points[i], CLUSTER_RADIUS, neighbours, false);
+                for (const auto &neighbour : neighbours)
+                {
+                    const std::size_t lhs = find(i);
+                    const std::size_t rhs = find(neighbour.first);
+                    parents[std::max(lhs, rhs)] = std::min(lhs, rhs);
+                }
+            }
+            std::size_t caller_clusters = 0UL;
+            for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+            {
+                caller_clusters += (find(i) == i) ? 1UL : 0UL;
+            }
+            auto t2 = std::chrono::high_resolution_clock::now();
+
+            EuclideanClusterOptions options;
+            options.radius = CLUSTER_RADIUS;
+            auto t3 = std::chrono::high_resolution_clock::now();
+            const std::vector<std::size_t> labels = euclideanClusters(kdtree, options);
+            auto t4 = std::chrono::high_resolution_clock::now();
+
+            options.min_points = 3UL;
+            auto t5 = std::chrono::high_resolution_clock::now();
+            const std::vector<std::size_t> density_labels = euclideanClusters(kdtree, options);
+            auto t6 = std::chrono::high_resolution_clock::now();
+
+            std::cout << "Euclidean clustering of " << NUM_PTS << " points, caller merged: "
+                      << std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count() / 1.0e9 << " ("
+                      << caller_clusters << " clusters), library: "
+                      << std::chrono::duration_cast<std::chrono::nanoseconds>(t4 - t3).count() / 1.0e9 << " ("
+                      << *std::max_element(labels.begin(), labels.end()) + 1UL << " clusters), DBSCAN with 3 points: "
+                      << std::chrono::duration_cast<std::chrono::nanoseconds>(t6 - t5).count() / 1.0e9 << std::endl
+                      << std::endl;
+        }
+        // Batched queries in input order against sorted by the leaf bucket they fall into
+        {
+            KDTree<double, NUM_DIM> kdtree(points);
+
+            std::vector<point_t<double, NUM_DIM>> points_of_interest;
+            for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+            {
+                points_of_interest.push_back({dist(gen), dist(gen), dist(gen)});
+            }
+
+            for (const bool sort_queries : {false, true})
+            {
+                KDTreeSearchOptions options;
+                options.sort_queries = sort_queries;
+
+                std::vector<std::size_t> neighbour_indices;
+                auto t1 = std::chrono::high_resolution_clock::now();
+                kdtree.nearest(points_of_interest, neighbour_indices, options);
+                auto t2 = std::chrono::high_resolution_clock::now();
+
+                std::vector<std::vector<KDTree<double, NUM_DIM>::neighbour_t>> neighbours;
+                auto t3 = std::chrono::high_resolution_clock::now();
+                kdtree.knearest(points_of_interest, 8UL, neighbours, options);
+                auto t4 = std::chrono::high_resolution_clock::now();
+                std::cout << (sort_queries ? "Sorted" : "Unsorted") << " batch of " << NUM_PTS
+                          << " queries, nearest neighbour: "
+                          << std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count() / 1.0e9
+                          << ", 8 nearest neighbours: "
+                          << std::chrono::duration_cast<std::chrono::nanoseconds>(t4 - t3).count() / 1.0e9 << std::endl;
+            }
+            std::cout << std::endl;
+        }
+        // Save the tree and open it again by mapping the file
+        {
+            KDTree<double, NUM_DIM> kdtree(points);
+            const std::string path = "kdtree_benchmark.bin";
+
+            auto t1 = std::chrono::high_resolution_clock::now();
+            kdtree.save(path);
+            auto t2 = std::chrono::high_resolution_clock::now();
+            KDTree<double, NUM_DIM> opened = KDTree<double, NUM_DIM>::open(path);
+            auto t3 = std::chrono::high_resolution_clock::now();
+            std::cout << "Time elapsed for saving the kdtree: "
+                      << std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count() / 1.0e9
+                      << ", opening it: "
+                      << std::chrono::duration_cast<std::chrono::nanoseconds>(t3 - t2).count() / 1.0e9 << std::endl
+                      << std::endl;
+            std::remove(path.c_str());
+        }
+        // Dynamic tree, growing by single inserts and batches
+        {
+            DynamicKDTree<double, NUM_DIM> kdtree;
+
+            auto t1 = std::chrono::high_resolution_clock::now();
+            for (std::size_t i = 0UL; i < NUM_PTS / 10UL; ++i)
+            {
+                kdtree.insert(points[i]);
+            }
+            auto t2 = std::chrono::high_resolution_clock::now();
+            for (std::size_t i = NUM_PTS / 10UL; i < NUM_PTS; i += 10'000UL)
+            {
+                kdtree.insert(std::vector<point_t<double, NUM_DIM>>(points.begin() + i, points.begin() + i + 10'000UL));
+            }
+            auto t3 = std::chrono::high_resolution_clock::now();
+            for (std::size_t id = 0UL; id < NUM_PTS; id += 2UL)
+            {
+                kdtree.erase(id);
+            }
+            auto t4 = std::chrono::high_resolution_clock::now();
+            std::cout << "Dynamic tree: " << NUM_PTS / 10UL << " single inserts: "
+                      << std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count() / 1.0e9
+                      << ", batches of 10000: "
+                      << std::chrono::duration_cast<std::chrono::nanoseconds>(t3 - t2).count() / 1.0e9
+                      << ", erasing half of the points: "
+                      << std::chrono::duration_cast<std::chrono::nanoseconds>(t4 - t3).count() / 1.0e9 << std::endl
+                      << std::endl;
+        }
+        // View over a caller owned buffer, which is partitioned by index without copying the coordinates
+        {
+            std::vector<double> buffer;
+            buffer.reserve(NUM_PTS * NUM_DIM);
+            for (const auto &point : points)
+            {
+                buffer.insert(buffer.end(), point.begin(), point.end());
+            }
+
+            std::vector<point_t<double, NUM_DIM>> points_of_interest;
+            for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+            {
+                points_of_interest.push_back({dist(gen), dist(gen), dist(gen)});
+            }
+
+            auto t1 = std::chrono::high_resolution_clock::now();
+            KDTreeView<double, NUM_DIM> kdtree(buffer.data(), NUM_PTS);
+            auto t2 = std::chrono::high_resolution_clock::now();
+
+            std::vector<std::size_t> neighbour_indices;
+            auto t3 = std::chrono::high_resolution_clock::now();
+            kdtree.nearest(points_of_interest, neighbour_indices);
+            auto t4 = std::chrono::high_resolution_clock::now();
+            std::cout << "View construction: "
+                      << std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count() / 1.0e9
+                      << ", nearest neighbour search (many-to-many): "
+                      << std::chrono::duration_cast<std::chrono::nanoseconds>(t4 - t3).count() / 1.0e9 << std::endl
+                      << std::endl;
+        }
+        // Float and integer coordinates, whose distances are computed in float and 128 bit integers
+        {
+            std::vector<point_t<double, NUM_DIM>> points_of_interest;
+            for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+            {
+                points_of_interest.push_back({dist(gen), dist(gen), dist(gen)});
+            }
+
+            benchmarkCoordinateType<float>("Float coordinates", points, points_of_interest);
+            benchmarkCoordinateType<std::int32_t>("Integer coordinates", points, points_of_interest);
+            std::cout << std::endl;
+        }
+        // Array of structs against struct of arrays coordinate storage
+        {
+            std::vector<point_t<double, NUM_DIM>> points_of_interest;
+            for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+            {
+                points_of_interest.push_back({dist(gen), dist(gen), dist(gen)});
+            }
+
+            benchmarkLayout<ArrayOfStructs>("Array of structs", points, points_of_interest);
+            benchmarkLayout<StructOfArrays>("Struct of arrays", points, points_of_interest);
+            std::cout << std::endl;
+        }
+        // Clustered points, which leave most cells of the partition nearly empty
+        {
+            std::normal_distribution<double> spread(0.0, 0.05);
+            std::vector<point_t<double, NUM_DIM>> clustered_points;
+            clustered_points.reserve(NUM_PTS);
+            for (std::size_t cluster = 0UL; cluster < 100UL; ++cluster)
+            {
+                const point_t<double, NUM_DIM> center{dist(gen), dist(gen), dist(gen)};
+                for (std::size_t i = 0UL; i < NUM_PTS / 100UL; ++i)
+                {
+                    clustered_points.push_back(
+                        {center[0] + spread(gen), center[1] + spread(gen), center[2] + spread(gen)});
+                }
+            }
+
+            std::vector<point_t<double, NUM_DIM>> points_of_interest;
+            for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+            {
+                points_of_interest.push_back({dist(gen), dist(gen), dist(gen)});
+            }
+
+            KDTree<double, NUM_DIM> kdtree(clustered_points);
+            std::vector<point_t<double, NUM_DIM>> neighbour_points;
+            auto t1 = std::chrono::high_resolution_clock::now();
+            kdtree.nearest(points_of_interest, neighbour_points);
+            auto t2 = std::chrono::high_resolution_clock::now();
+            std::cout << "Time elapsed for nearest neighbour search in clustered points (many-to-many): "
+                      << std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count() / 1.0e9 << std::endl
+                      << std::endl;
+        }
+        // Work per nearest neighbour query for the split rules and leaf sizes, counted by an instrumented tree
+        {
+            std::vector<point_t<double, NUM_DIM>> points_of_interest;
+            for (std::size_t i = 0UL; i < 100'000UL; ++i)
+            {
+                points_of_interest.push_back({dist(gen), dist(gen), dist(gen)});
+            }
+
+            const std::pair<SplitRule, std::string> split_rules[] = {{SplitRule::Cycle, "cycle"},
+                                                                     {SplitRule::MaxSpread, "max spread"},
+                                                                     {SplitRule::MaxVariance, "max variance"}};
+            for (const auto &[split_rule, name] : split_rules)
+            {
+                for (const std::size_t leaf_size : {8UL, 16UL, 32UL})
+                {
+                    KDTreeBuildOptions options;
+                    options.split_rule = split_rule;
+                    options.leaf_size = leaf_size;
+                    KDTree<double, NUM_DIM, ArrayOfStructs, EuclideanMetric, true> kdtree(points, options);
+
+                    std::vector<point_t<double, NUM_DIM>> neighbour_points;
+                    kdtree.nearest(points_of_interest, neighbour_points);
+                    const KDTreeQueryStats stats = kdtree.queryStats();
+                    const double queries = static_cast<double>(stats.queries);
+                    std::cout << "Split rule " << name << ", leaf size " << leaf_size
+                              << ": nodes visited per query: " << stats.nodes_visited / queries
+                              << ", leaves scanned: " << stats.leaves_scanned / queries
+                              << ", distance evaluations: " << stats.distance_evaluations / queries
+                              << ", subtrees pruned: " << stats.subtrees_pruned / queries
+                              << ", maximum stack depth: " << stats.max_stack_depth << std::endl;
+                }
+            }
+            std::cout << std::endl;
+        }
+        // K nearest neighbours
+        {
+            KDTree<double, NUM_DIM> kdtree(points, true);
+
+            constexpr std::size_t K = 10UL;
+            point_t<double, NUM_DIM> point_of_interest = {0.5, 0.3, 0.2};
+
+            std::vector<point_t<double, NUM_DIM>> neighbours;
+            std::vector<double> distances;
+
+            auto t3 = std::chrono::high_resolution_clock::now();
+            kdtree.knearest(point_of_interest, K, neighbours, distances);
+            auto t4 = std::chrono::high_resolution_clock::now();
+            std::cout << "Time elapsed for " << K << " nearest neighbours search: "
+                      << std::chrono::duration_cast<std::chrono::nanoseconds>(t4 - t3).count() / 1.0e9 << std::endl
+                      << std::endl;
+        }
         // Neighbours within radius
         {
             // Build the KD-Tree
@@ -139,6 +692,32 @@ int main()
             //               << distance << std::endl;
             // }
         }
+        // Points inside axis-aligned boxes
+        {
+            KDTree<double, NUM_DIM> kdtree(points);
+
+            std::vector<KDTree<double, NUM_DIM>::box_t> boxes;
+            for (std::size_t i = 0UL; i < 10'000UL; ++i)
+            {
+                const point_t<double, NUM_DIM> low{dist(gen), dist(gen), dist(gen)};
+                boxes.emplace_back(low, point_t<double, NUM_DIM>{low[0] + 2.0, low[1] + 2.0, low[2] + 2.0});
+            }
+
+            std::vector<std::size_t> counts;
+            auto t1 = std::chrono::high_resolution_clock::now();
+            kdtree.rangeCount(boxes, counts);
+            auto t2 = std::chrono::high_resolution_clock::now();
+
+            std::vector<std::vector<std::size_t>> indices;
+            auto t3 = std::chrono::high_resolution_clock::now();
+            kdtree.rangeQuery(boxes, indices);
+            auto t4 = std::chrono::high_resolution_clock::now();
+            std::cout << "Time elapsed for counting the points in 10000 boxes: "
+                      << std::chrono::duration_cast<std::chrono::nanoseconds>(t2 - t1).count() / 1.0e9
+                      << ", collecting them: "
+                      << std::chrono::duration_cast<std::chrono::nanoseconds>(t4 - t3).count() / 1.0e9 << std::endl
+                      << std::endl;
+        }
         // Neighbors within radius, many to many
         {
             // Recreate points, because this approach requires quite a bit of memory
@@ -170,6 +749,16 @@ int main()
             std::cout << "Time elapsed for radius neighbour search with " << REDUCED_NUMBER_OF_POINTS
                       << " points (many-to-many): "
                       << std::chrono::duration_cast<std::chrono::nanoseconds>(t4 - t3).count() / 1.0e9 << std::endl;
+
+            // Same search with the flat compressed sparse row output
+            KDTreeRadiusNeighbours flat_neighbours;
+
+            auto t5 = std::chrono::high_resolution_clock::now();
+            kdtree.findNeighborsWithinRadius(points_of_interest, 5.0, flat_neighbours, true);
+            auto t6 = std::chrono::high_resolution_clock::now();
+            std::cout << "Time elapsed for radius neighbour search with " << REDUCED_NUMBER_OF_POINTS
+                      << " points (many-to-many, flat output): "
+                      << std::chrono::duration_cast<std::chrono::nanoseconds>(t6 - t5).count() / 1.0e9 << std::endl;
         }
     }
     catch (const std::exception &ex)
@@ -1,11 +1,18 @@
+#include "clustering.hpp"
 #include "kdtree.hpp"
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
 #include <limits>
+#include <memory>
 #include <random>
 #include <string>
-#include <thread>
+#include <type_traits>
 
 TEST(KDTreeTest, matchesBruteForce)
 {
@@ -92,7 +99,7 @@ TEST(KDTreeTest, parallelMatchesBruteForce)
     closest_points_kdtree.reserve(test_points.size());
 
     KDTree<double, NUM_DIM> kdtree(points, true);
-    kdtree.nearest(test_points, closest_points_kdtree, std::thread::hardware_concurrency());
+    kdtree.nearest(test_points, closest_points_kdtree);
 
     for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
     {
@@ -212,6 +219,1812 @@ TEST(KDTreeTest, canFindAllElementsWithinRadius)
     }
 }
 
+TEST(KDTreeTest, knearestMatchesBruteForce)
+{
+    constexpr std::size_t NUM_PTS = 10'000UL;
+    constexpr std::size_t NUM_TEST_PTS = 200UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+    constexpr std::size_t K = 10UL;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<double> dist(-10.0, 10.0);
+
+    std::vector<point_t<double, NUM_DIM>> points;
+    points.reserve(NUM_PTS);
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    std::vector<point_t<double, NUM_DIM>> test_points;
+    test_points.reserve(NUM_TEST_PTS);
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        test_points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    KDTree<double, NUM_DIM> kdtree(points, true);
+
+    std::vector<std::vector<point_t<double, NUM_DIM>>> neighbours_batch;
+    std::vector<std::vector<double>> distances_batch;
+    kdtree.knearest(test_points, K, neighbours_batch, distances_batch);
+    ASSERT_EQ(neighbours_batch.size(), NUM_TEST_PTS);
+
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        const auto &test_point = test_points[i];
+
+        std::vector<point_t<double, NUM_DIM>> neighbours_kdtree;
+        std::vector<double> distances_kdtree;
+        kdtree.knearest(test_point, K, neighbours_kdtree, distances_kdtree);
+
+        // Find k closest distances using brute force
+        std::vector<double> distances_brute_force;
+        distances_brute_force.reserve(points.size());
+        for (const auto &point : points)
+        {
+            double dist_sqr = 0.0;
+            for (std::size_t dim = 0; dim < NUM_DIM; ++dim)
+            {
+                double delta = point[dim] - test_point[dim];
+                dist_sqr += delta * delta;
+            }
+            distances_brute_force.emplace_back(dist_sqr);
+        }
+        std::partial_sort(distances_brute_force.begin(), distances_brute_force.begin() + K,
+                          distances_brute_force.end());
+
+        ASSERT_EQ(neighbours_kdtree.size(), K);
+        ASSERT_EQ(distances_kdtree.size(), K);
+        ASSERT_EQ(distances_batch[i].size(), K);
+        for (std::size_t j = 0UL; j < K; ++j)
+        {
+            ASSERT_DOUBLE_EQ(distances_brute_force[j], distances_kdtree[j]);
+            ASSERT_DOUBLE_EQ(distances_brute_force[j], distances_batch[i][j]);
+            for (std::size_t dim = 0; dim < NUM_DIM; ++dim)
+            {
+                ASSERT_DOUBLE_EQ(neighbours_kdtree[j][dim], neighbours_batch[i][j][dim]);
+            }
+        }
+    }
+
+    // Asking for more neighbours than there are points returns the whole tree
+    ASSERT_EQ(kdtree.knearest(test_points.front(), NUM_PTS + 5UL).size(), NUM_PTS);
+    ASSERT_TRUE(kdtree.knearest(test_points.front(), 0UL).empty());
+}
+
+TEST(KDTreeTest, copiedTreeOutlivesOriginal)
+{
+    constexpr std::size_t NUM_PTS = 1'000UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<double> dist(-10.0, 10.0);
+
+    std::vector<point_t<double, NUM_DIM>> points;
+    points.reserve(NUM_PTS);
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    // The node layout holds no pointers, so copies and moves must stay valid on their own
+    auto original = std::make_unique<KDTree<double, NUM_DIM>>(points, true);
+    KDTree<double, NUM_DIM> copied(*original);
+    KDTree<double, NUM_DIM> moved(std::move(*original));
+    original.reset();
+
+    for (const auto &point : points)
+    {
+        auto closest_copied = copied.nearest(point);
+        auto closest_moved = moved.nearest(point);
+        for (std::size_t dim = 0; dim < NUM_DIM; ++dim)
+        {
+            ASSERT_DOUBLE_EQ(point[dim], closest_copied[dim]);
+            ASSERT_DOUBLE_EQ(point[dim], closest_moved[dim]);
+        }
+    }
+}
+
+TEST(KDTreeTest, leafBucketsMatchBruteForce)
+{
+    constexpr std::size_t NUM_PTS = 5'000UL;
+    constexpr std::size_t NUM_TEST_PTS = 200UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+    constexpr double SEARCH_RADIUS = 2.0;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<double> dist(-10.0, 10.0);
+
+    std::vector<point_t<double, NUM_DIM>> points;
+    points.reserve(NUM_PTS);
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    std::vector<point_t<double, NUM_DIM>> test_points;
+    test_points.reserve(NUM_TEST_PTS);
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        test_points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    for (const std::size_t leaf_size : {1UL, 8UL, 64UL, 100UL, NUM_PTS})
+    {
+        KDTreeBuildOptions options;
+        options.threaded = (leaf_size % 2UL == 0UL);
+        options.leaf_size = leaf_size;
+        KDTree<double, NUM_DIM> kdtree(points, options);
+
+        for (const auto &test_point : test_points)
+        {
+            // Find closest distance and number of points within radius using brute force
+            double best_distance = std::numeric_limits<double>::max();
+            std::size_t number_within_radius = 0UL;
+            for (const auto &point : points)
+            {
+                double dist_sqr = 0.0;
+                for (std::size_t dim = 0; dim < NUM_DIM; ++dim)
+                {
+                    double delta = point[dim] - test_point[dim];
+                    dist_sqr += delta * delta;
+                }
+                best_distance = std::min(best_distance, dist_sqr);
+                number_within_radius += (dist_sqr <= SEARCH_RADIUS * SEARCH_RADIUS) ? 1UL : 0UL;
+            }
+
+            auto closest_point_kdtree = kdtree.nearest(test_point);
+            double closest_distance_kdtree = 0.0;
+            for (std::size_t dim = 0; dim < NUM_DIM; ++dim)
+            {
+                double delta = closest_point_kdtree[dim] - test_point[dim];
+                closest_distance_kdtree += delta * delta;
+            }
+            ASSERT_DOUBLE_EQ(best_distance, closest_distance_kdtree);
+
+            std::vector<point_t<double, NUM_DIM>> neighbours_kdtree;
+            std::vector<double> distances_kdtree;
+            kdtree.knearest(test_point, 5UL, neighbours_kdtree, distances_kdtree);
+            ASSERT_DOUBLE_EQ(best_distance, distances_kdtree.front());
+
+            kdtree.findNeighborsWithinRadius(test_point, SEARCH_RADIUS, neighbours_kdtree, distances_kdtree, true);
+            ASSERT_EQ(number_within_radius, neighbours_kdtree.size());
+        }
+    }
+
+    KDTreeBuildOptions options;
+    options.leaf_size = 0UL;
+    ASSERT_THROW((KDTree<double, NUM_DIM>(points, options)), std::invalid_argument);
+}
+
+TEST(KDTreeTest, structOfArraysMatchesArrayOfStructs)
+{
+    constexpr std::size_t NUM_PTS = 10'000UL;
+    constexpr std::size_t NUM_TEST_PTS = 500UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+    constexpr double SEARCH_RADIUS = 2.0;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<float> dist(-10.0F, 10.0F);
+
+    std::vector<point_t<float, NUM_DIM>> points;
+    points.reserve(NUM_PTS);
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    std::vector<point_t<float, NUM_DIM>> test_points;
+    test_points.reserve(NUM_TEST_PTS);
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        test_points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    KDTree<float, NUM_DIM, ArrayOfStructs> kdtree_aos(points, true);
+    KDTree<float, NUM_DIM, StructOfArrays> kdtree_soa(points, true);
+
+    std::vector<point_t<float, NUM_DIM>> closest_points_aos;
+    std::vector<point_t<float, NUM_DIM>> closest_points_soa;
+    kdtree_aos.nearest(test_points, closest_points_aos);
+    kdtree_soa.nearest(test_points, closest_points_soa);
+
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        // Both layouts are built by the same partitioning, so they must agree exactly
+        ASSERT_EQ(closest_points_aos[i], closest_points_soa[i]);
+
+        std::vector<point_t<float, NUM_DIM>> neighbours_aos;
+        std::vector<point_t<float, NUM_DIM>> neighbours_soa;
+        std::vector<double> distances_aos;
+        std::vector<double> distances_soa;
+        kdtree_aos.findNeighborsWithinRadius(test_points[i], SEARCH_RADIUS, neighbours_aos, distances_aos, true);
+        kdtree_soa.findNeighborsWithinRadius(test_points[i], SEARCH_RADIUS, neighbours_soa, distances_soa, true);
+        ASSERT_EQ(neighbours_aos.size(), neighbours_soa.size());
+        ASSERT_EQ(distances_aos, distances_soa);
+
+        ASSERT_EQ(kdtree_aos.knearest(test_points[i], 8UL), kdtree_soa.knearest(test_points[i], 8UL));
+    }
+}
+
+TEST(KDTreeTest, indexQueriesReferToInputPoints)
+{
+    constexpr std::size_t NUM_PTS = 10'000UL;
+    constexpr std::size_t NUM_TEST_PTS = 500UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+    constexpr double SEARCH_RADIUS = 2.0;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<double> dist(-10.0, 10.0);
+
+    std::vector<point_t<double, NUM_DIM>> points;
+    std::vector<std::string> labels;
+    points.reserve(NUM_PTS);
+    labels.reserve(NUM_PTS);
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        points.push_back({dist(gen), dist(gen), dist(gen)});
+        labels.push_back("point_" + std::to_string(i));
+    }
+
+    std::vector<point_t<double, NUM_DIM>> test_points;
+    test_points.reserve(NUM_TEST_PTS);
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        test_points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    KDTreeWithPayload<KDTree<double, NUM_DIM>, std::string> kdtree(labels, points, true);
+    ASSERT_EQ(kdtree.size(), NUM_PTS);
+
+    std::vector<std::size_t> closest_indices;
+    kdtree.nearest(test_points, closest_indices);
+
+    std::vector<std::vector<KDTree<double, NUM_DIM>::neighbour_t>> neighbours_batch;
+    kdtree.findNeighborsWithinRadius(test_points, SEARCH_RADIUS, neighbours_batch, true);
+
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        const auto &test_point = test_points[i];
+
+        const std::size_t closest_index = kdtree.nearestIndex(test_point);
+        ASSERT_EQ(closest_index, closest_indices[i]);
+        ASSERT_EQ(points[closest_index], kdtree.nearest(test_point));
+        ASSERT_EQ(labels[closest_index], kdtree.nearestPayload(test_point));
+
+        std::vector<KDTree<double, NUM_DIM>::neighbour_t> neighbours;
+        kdtree.knearest(test_point, 5UL, neighbours);
+        ASSERT_EQ(neighbours.size(), 5UL);
+        ASSERT_EQ(neighbours.front().first, closest_index);
+
+        std::vector<point_t<double, NUM_DIM>> neighbour_points;
+        std::vector<double> distances;
+        kdtree.findNeighborsWithinRadius(test_point, SEARCH_RADIUS, neighbour_points, distances, true);
+        ASSERT_EQ(neighbour_points.size(), neighbours_batch[i].size());
+        for (std::size_t j = 0UL; j < neighbours_batch[i].size(); ++j)
+        {
+            const auto &[index, distance] = neighbours_batch[i][j];
+            ASSERT_EQ(labels[index], kdtree.payload(index));
+            ASSERT_DOUBLE_EQ(distances[j], distance);
+            ASSERT_EQ(points[index], neighbour_points[j]);
+        }
+    }
+
+    ASSERT_THROW((KDTreeWithPayload<KDTree<double, NUM_DIM>, std::string>({"a"}, points, true)),
+                 std::invalid_argument);
+}
+
+TEST(KDTreeTest, splitRulesMatchBruteForceOnFlatData)
+{
+    constexpr std::size_t NUM_PTS = 10'000UL;
+    constexpr std::size_t NUM_TEST_PTS = 300UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+    constexpr double SEARCH_RADIUS = 1.5;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<double> dist(-10.0, 10.0);
+    std::uniform_real_distribution<double> dist_flat(-0.01, 0.01);
+
+    // Points spread in x and y, but almost without extent in z
+    std::vector<point_t<double, NUM_DIM>> points;
+    points.reserve(NUM_PTS);
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        points.push_back({dist(gen), dist(gen), dist_flat(gen)});
+    }
+
+    std::vector<point_t<double, NUM_DIM>> test_points;
+    test_points.reserve(NUM_TEST_PTS);
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        test_points.push_back({dist(gen), dist(gen), dist_flat(gen)});
+    }
+
+    for (const SplitRule split_rule :
+         {SplitRule::Cycle, SplitRule::MaxSpread, SplitRule::MaxVariance, SplitRule::RandomizedVariance})
+    {
+        KDTreeBuildOptions options;
+        options.split_rule = split_rule;
+        options.leaf_size = 4UL;
+        KDTree<double, NUM_DIM> kdtree(points, options);
+
+        for (const auto &test_point : test_points)
+        {
+            double best_distance = std::numeric_limits<double>::max();
+            std::size_t best_index = 0UL;
+            std::size_t number_within_radius = 0UL;
+            for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+            {
+                double dist_sqr = 0.0;
+                for (std::size_t dim = 0; dim < NUM_DIM; ++dim)
+                {
+                    double delta = points[i][dim] - test_point[dim];
+                    dist_sqr += delta * delta;
+                }
+                if (dist_sqr < best_distance)
+                {
+                    best_distance = dist_sqr;
+                    best_index = i;
+                }
+                number_within_radius += (dist_sqr <= SEARCH_RADIUS * SEARCH_RADIUS) ? 1UL : 0UL;
+            }
+
+            ASSERT_EQ(best_index, kdtree.nearestIndex(test_point));
+
+            std::vector<KDTree<double, NUM_DIM>::neighbour_t> neighbours;
+            kdtree.knearest(test_point, 3UL, neighbours);
+            ASSERT_EQ(best_index, neighbours.front().first);
+
+            kdtree.findNeighborsWithinRadius(test_point, SEARCH_RADIUS, neighbours, false);
+            ASSERT_EQ(number_within_radius, neighbours.size());
+        }
+    }
+}
+
+TEST(KDTreeTest, handlesManyDuplicatePoints)
+{
+    constexpr std::size_t NUM_PTS = 100'000UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+
+    // Half of the points are identical, the other half lie on a single line
+    std::vector<point_t<double, NUM_DIM>> points;
+    points.reserve(NUM_PTS);
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        points.push_back({(i % 2UL == 0UL) ? 1.0 : static_cast<double>(i), 2.0, 3.0});
+    }
+
+    KDTreeBuildOptions options;
+    options.leaf_size = 1UL;
+    KDTree<double, NUM_DIM> kdtree(points, options);
+
+    ASSERT_EQ(kdtree.nearest({1.0, 2.0, 3.0}), (point_t<double, NUM_DIM>{1.0, 2.0, 3.0}));
+    ASSERT_EQ(kdtree.nearest({4.2, 2.0, 3.0}), (point_t<double, NUM_DIM>{5.0, 2.0, 3.0}));
+
+    std::vector<KDTree<double, NUM_DIM>::neighbour_t> neighbours;
+    kdtree.knearest({1.0, 2.0, 3.0}, 100UL, neighbours);
+    ASSERT_EQ(neighbours.size(), 100UL);
+    ASSERT_DOUBLE_EQ(neighbours.back().second, 0.0);
+
+    // Duplicates of the query point itself are excluded from the radius search
+    kdtree.findNeighborsWithinRadius({1.0, 2.0, 3.0}, 10.5, neighbours, true);
+    ASSERT_EQ(neighbours.size(), 5UL);
+}
+
+TEST(KDTreeTest, threadedBuildMatchesSequentialBuild)
+{
+    constexpr std::size_t NUM_PTS = 50'000UL;
+    constexpr std::size_t NUM_TEST_PTS = 500UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<double> dist(-10.0, 10.0);
+
+    std::vector<point_t<double, NUM_DIM>> points;
+    points.reserve(NUM_PTS);
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    std::vector<point_t<double, NUM_DIM>> test_points;
+    test_points.reserve(NUM_TEST_PTS);
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        test_points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    KDTree<double, NUM_DIM> kdtree_sequential(points, false);
+    std::vector<std::size_t> indices_sequential;
+    kdtree_sequential.nearest(test_points, indices_sequential);
+
+    for (const std::size_t thread_count : {1UL, 3UL, 8UL})
+    {
+        for (const std::size_t grain_size : {1UL, 1'000UL, NUM_PTS})
+        {
+            KDTreeBuildOptions options;
+            options.thread_count = thread_count;
+            options.grain_size = grain_size;
+            options.split_rule = SplitRule::MaxSpread;
+            KDTree<double, NUM_DIM> kdtree(points, options);
+
+            std::vector<std::size_t> indices;
+            kdtree.nearest(test_points, indices);
+            ASSERT_EQ(indices_sequential, indices);
+        }
+    }
+}
+
+TEST(KDTreeTest, approximateSearchStaysWithinErrorBound)
+{
+    constexpr std::size_t NUM_PTS = 20'000UL;
+    constexpr std::size_t NUM_TEST_PTS = 500UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+    constexpr std::size_t K = 5UL;
+    constexpr double EPSILON = 0.5;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<double> dist(-10.0, 10.0);
+
+    std::vector<point_t<double, NUM_DIM>> points;
+    points.reserve(NUM_PTS);
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    KDTree<double, NUM_DIM> kdtree(points, true);
+
+    KDTreeSearchOptions approximate;
+    approximate.epsilon = EPSILON;
+
+    KDTreeSearchOptions single_leaf;
+    single_leaf.max_leaves = 1UL;
+
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        const point_t<double, NUM_DIM> test_point{dist(gen), dist(gen), dist(gen)};
+
+        std::vector<KDTree<double, NUM_DIM>::neighbour_t> exact;
+        kdtree.knearest(test_point, K, exact);
+
+        // Each approximate neighbour is within (1 + epsilon) of the exact neighbour of the same rank
+        std::vector<KDTree<double, NUM_DIM>::neighbour_t> neighbours;
+        kdtree.knearest(test_point, K, neighbours, approximate);
+        ASSERT_EQ(neighbours.size(), K);
+        for (std::size_t j = 0UL; j < K; ++j)
+        {
+            ASSERT_LE(std::sqrt(neighbours[j].second), (1.0 + EPSILON) * std::sqrt(exact[j].second) + 1e-9);
+        }
+
+        const std::size_t index = kdtree.nearestIndex(test_point, approximate);
+        double distance_squared = 0.0;
+        for (std::size_t axis = 0UL; axis < NUM_DIM; ++axis)
+        {
+            distance_squared += (points[index][axis] - test_point[axis]) * (points[index][axis] - test_point[axis]);
+        }
+        ASSERT_LE(std::sqrt(distance_squared), (1.0 + EPSILON) * std::sqrt(exact.front().second) + 1e-9);
+
+        // A single leaf bucket still yields a result, but never a better one than the exact search
+        kdtree.knearest(test_point, K, neighbours, single_leaf);
+        ASSERT_FALSE(neighbours.empty());
+        ASSERT_GE(neighbours.front().second, exact.front().second);
+    }
+
+    // Zero options are exact
+    const point_t<double, NUM_DIM> test_point{0.5, 0.3, 0.2};
+    ASSERT_EQ(kdtree.nearest(test_point, KDTreeSearchOptions()), kdtree.nearest(test_point));
+}
+
+TEST(KDTreeTest, flatRadiusSearchMatchesNestedRadiusSearch)
+{
+    constexpr std::size_t NUM_PTS = 20'000UL;
+    constexpr std::size_t NUM_TEST_PTS = 1'000UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<double> dist(-10.0, 10.0);
+
+    std::vector<point_t<double, NUM_DIM>> points;
+    points.reserve(NUM_PTS);
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    // Some queries coincide with tree points, which are excluded from their own results
+    std::vector<point_t<double, NUM_DIM>> test_points;
+    test_points.reserve(NUM_TEST_PTS);
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        test_points.push_back((i % 10UL == 0UL) ? points[i]
+                                                : point_t<double, NUM_DIM>{dist(gen), dist(gen), dist(gen)});
+    }
+
+    KDTree<double, NUM_DIM> kdtree(points, true);
+
+    std::vector<std::vector<KDTree<double, NUM_DIM>::neighbour_t>> nested;
+    kdtree.findNeighborsWithinRadius(test_points, 1.5, nested, true);
+
+    KDTreeRadiusNeighbours flat;
+    kdtree.findNeighborsWithinRadius(test_points, 1.5, flat, true);
+
+    ASSERT_EQ(flat.offsets.size(), NUM_TEST_PTS + 1UL);
+    ASSERT_EQ(flat.offsets.front(), 0UL);
+    ASSERT_EQ(flat.indices.size(), flat.offsets.back());
+    ASSERT_EQ(flat.distances.size(), flat.offsets.back());
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        ASSERT_EQ(flat.offsets[i + 1UL] - flat.offsets[i], nested[i].size());
+        for (std::size_t j = 0UL; j < nested[i].size(); ++j)
+        {
+            ASSERT_DOUBLE_EQ(flat.distances[flat.offsets[i] + j], nested[i][j].second);
+        }
+    }
+
+    // Unsorted rows hold the same neighbours
+    kdtree.findNeighborsWithinRadius(test_points, 1.5, flat, false);
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        std::vector<std::size_t> expected;
+        for (const auto &neighbour : nested[i])
+        {
+            expected.push_back(neighbour.first);
+        }
+        std::vector<std::size_t> actual(flat.indices.begin() + flat.offsets[i],
+                                        flat.indices.begin() + flat.offsets[i + 1UL]);
+        std::sort(expected.begin(), expected.end());
+        std::sort(actual.begin(), actual.end());
+        ASSERT_EQ(expected, actual);
+    }
+}
+
+TEST(KDTreeTest, viewOverStridedBufferMatchesOwningTree)
+{
+    constexpr std::size_t NUM_PTS = 20'000UL;
+    constexpr std::size_t NUM_TEST_PTS = 500UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+    constexpr std::size_t STRIDE = 4UL;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<double> dist(-10.0, 10.0);
+
+    // Interleaved x, y, z and an unrelated fourth value per point
+    std::vector<double> buffer;
+    std::vector<point_t<double, NUM_DIM>> points;
+    buffer.reserve(NUM_PTS * STRIDE);
+    points.reserve(NUM_PTS);
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        points.push_back({dist(gen), dist(gen), dist(gen)});
+        buffer.insert(buffer.end(), points.back().begin(), points.back().end());
+        buffer.push_back(-1.0);
+    }
+    const std::vector<double> original_buffer = buffer;
+
+    std::vector<point_t<double, NUM_DIM>> test_points;
+    test_points.reserve(NUM_TEST_PTS);
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        test_points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    KDTree<double, NUM_DIM> kdtree(points, false);
+    std::vector<std::size_t> expected;
+    kdtree.nearest(test_points, expected);
+
+    for (const bool threaded : {false, true})
+    {
+        KDTreeBuildOptions options;
+        options.threaded = threaded;
+        options.split_rule = SplitRule::MaxVariance;
+        KDTreeView<double, NUM_DIM> view(buffer.data(), NUM_PTS, STRIDE, options);
+        ASSERT_EQ(view.size(), NUM_PTS);
+
+        std::vector<std::size_t> indices;
+        view.nearest(test_points, indices);
+        ASSERT_EQ(expected, indices);
+
+        std::vector<KDTreeView<double, NUM_DIM>::neighbour_t> neighbours;
+        view.knearest(test_points.front(), 10UL, neighbours);
+        std::vector<KDTree<double, NUM_DIM>::neighbour_t> expected_neighbours;
+        kdtree.knearest(test_points.front(), 10UL, expected_neighbours);
+        ASSERT_EQ(expected_neighbours, neighbours);
+    }
+
+    // The caller buffer is left untouched
+    ASSERT_EQ(original_buffer, buffer);
+    ASSERT_THROW((KDTreeView<double, NUM_DIM>(buffer.data(), NUM_PTS, 2UL)), std::invalid_argument);
+}
+
+TEST(KDTreeTest, savedTreeOpensWithSameResults)
+{
+    constexpr std::size_t NUM_PTS = 20'000UL;
+    constexpr std::size_t NUM_TEST_PTS = 500UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<double> dist(-10.0, 10.0);
+
+    std::vector<point_t<double, NUM_DIM>> points;
+    points.reserve(NUM_PTS);
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    std::vector<point_t<double, NUM_DIM>> test_points;
+    test_points.reserve(NUM_TEST_PTS);
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        test_points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    const std::string path = testing::TempDir() + "kdtree_saved_tree.bin";
+
+    KDTreeBuildOptions options;
+    options.leaf_size = 8UL;
+    options.split_rule = SplitRule::MaxSpread;
+    KDTree<double, NUM_DIM> kdtree(points, options);
+    kdtree.save(path);
+
+    std::vector<std::size_t> expected;
+    kdtree.nearest(test_points, expected);
+
+    std::unique_ptr<KDTree<double, NUM_DIM>> opened =
+        std::make_unique<KDTree<double, NUM_DIM>>(KDTree<double, NUM_DIM>::open(path));
+    ASSERT_EQ(opened->size(), NUM_PTS);
+
+    std::vector<std::size_t> indices;
+    opened->nearest(test_points, indices);
+    ASSERT_EQ(expected, indices);
+
+    // Copies share the mapping, which stays valid after the opened tree is gone
+    KDTree<double, NUM_DIM> copy = *opened;
+    opened.reset();
+    copy.nearest(test_points, indices);
+    ASSERT_EQ(expected, indices);
+
+    std::vector<KDTree<double, NUM_DIM>::neighbour_t> neighbours;
+    std::vector<KDTree<double, NUM_DIM>::neighbour_t> expected_neighbours;
+    kdtree.findNeighborsWithinRadius(test_points.front(), 2.0, expected_neighbours, true);
+    copy.findNeighborsWithinRadius(test_points.front(), 2.0, neighbours, true);
+    ASSERT_EQ(expected_neighbours, neighbours);
+    const point_t<double, NUM_DIM> low{-5.0, -5.0, -5.0};
+    const point_t<double, NUM_DIM> high{5.0, 5.0, 5.0};
+    ASSERT_EQ(copy.rangeCount(low, high), kdtree.rangeCount(low, high));
+
+    // A struct of arrays tree holds one section per axis
+    KDTree<double, NUM_DIM, StructOfArrays> kdtree_soa(points, options);
+    kdtree_soa.save(path);
+    KDTree<double, NUM_DIM, StructOfArrays>::open(path).nearest(test_points, indices);
+    ASSERT_EQ(expected, indices);
+
+    // Trees of another type are rejected
+    ASSERT_THROW((KDTree<double, NUM_DIM>::open(path)), std::runtime_error);
+    ASSERT_THROW((KDTree<float, NUM_DIM, StructOfArrays>::open(path)), std::runtime_error);
+    ASSERT_THROW((KDTree<double, NUM_DIM>::open(path + ".missing")), std::runtime_error);
+
+    // A split axis out of range is rejected. The axes follow the header, the points and the indices, every
+    // section starting at a multiple of KDTREE_FILE_ALIGNMENT.
+    kdtree.save(path);
+    auto align = [](std::size_t offset) -> std::size_t {
+        return (offset + KDTREE_FILE_ALIGNMENT - 1UL) / KDTREE_FILE_ALIGNMENT * KDTREE_FILE_ALIGNMENT;
+    };
+    const std::size_t axes_offset =
+        align(align(align(sizeof(KDTreeFileHeader)) + NUM_PTS * sizeof(point_t<double, NUM_DIM>)) +
+              NUM_PTS * sizeof(std::size_t));
+    {
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(static_cast<std::streamoff>(axes_offset));
+        file.put(static_cast<char>(NUM_DIM));
+    }
+    ASSERT_THROW((KDTree<double, NUM_DIM>::open(path)), std::runtime_error);
+
+    // So is an index out of range, the indices following the points
+    kdtree.save(path);
+    {
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(static_cast<std::streamoff>(align(align(sizeof(KDTreeFileHeader)) +
+                                                     NUM_PTS * sizeof(point_t<double, NUM_DIM>))));
+        const std::size_t index = NUM_PTS;
+        file.write(reinterpret_cast<const char *>(&index), sizeof(index));
+    }
+    ASSERT_THROW((KDTree<double, NUM_DIM>::open(path)), std::runtime_error);
+
+    // And a size whose sections wrap around to zero bytes, followed by a leaf size as large and no split axes
+    kdtree.save(path);
+    {
+        const std::uint64_t size = 1ULL << 61U;
+        const std::uint64_t axes_size = 0UL;
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(static_cast<std::streamoff>(offsetof(KDTreeFileHeader, size_)));
+        file.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        file.write(reinterpret_cast<const char *>(&size), sizeof(size));
+        file.write(reinterpret_cast<const char *>(&axes_size), sizeof(axes_size));
+    }
+    ASSERT_THROW((KDTree<double, NUM_DIM>::open(path)), std::runtime_error);
+
+    std::remove(path.c_str());
+}
+
+TEST(KDTreeTest, dynamicTreeMatchesBruteForceAfterInsertAndErase)
+{
+    constexpr std::size_t NUM_PTS = 5'000UL;
+    constexpr std::size_t NUM_TEST_PTS = 200UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+    constexpr std::size_t K = 8UL;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<double> dist(-10.0, 10.0);
+
+    DynamicKDTree<double, NUM_DIM> kdtree;
+    ASSERT_THROW(kdtree.nearestIndex({0.0, 0.0, 0.0}), std::logic_error);
+
+    // Single inserts, a batch insert, and erasing about two thirds of the points forces compactions
+    std::vector<point_t<double, NUM_DIM>> points;
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        points.push_back({dist(gen), dist(gen), dist(gen)});
+        ASSERT_EQ(kdtree.insert(points.back()), i);
+    }
+    std::vector<point_t<double, NUM_DIM>> batch;
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        batch.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+    ASSERT_EQ(kdtree.insert(batch), NUM_PTS);
+    points.insert(points.end(), batch.begin(), batch.end());
+
+    std::vector<bool> live(points.size(), true);
+    for (std::size_t id = 0UL; id < points.size(); ++id)
+    {
+        if (id % 3UL != 0UL)
+        {
+            ASSERT_TRUE(kdtree.erase(id));
+            live[id] = false;
+        }
+    }
+    ASSERT_FALSE(kdtree.erase(1UL));
+    ASSERT_FALSE(kdtree.erase(points.size()));
+    ASSERT_EQ(kdtree.size(), std::count(live.begin(), live.end(), true));
+
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        const point_t<double, NUM_DIM> test_point{dist(gen), dist(gen), dist(gen)};
+
+        std::vector<std::pair<double, std::size_t>> expected;
+        for (std::size_t id = 0UL; id < points.size(); ++id)
+        {
+            if (live[id])
+            {
+                double distance = 0.0;
+                for (std::size_t axis = 0UL; axis < NUM_DIM; ++axis)
+                {
+                    distance += (points[id][axis] - test_point[axis]) * (points[id][axis] - test_point[axis]);
+                }
+                expected.emplace_back(distance, id);
+            }
+        }
+        std::sort(expected.begin(), expected.end());
+
+        ASSERT_EQ(kdtree.nearestIndex(test_point), expected.front().second);
+        ASSERT_EQ(kdtree.nearest(test_point), points[expected.front().second]);
+
+        std::vector<DynamicKDTree<double, NUM_DIM>::neighbour_t> neighbours;
+        kdtree.knearest(test_point, K, neighbours);
+        ASSERT_EQ(neighbours.size(), K);
+        for (std::size_t j = 0UL; j < K; ++j)
+        {
+            ASSERT_EQ(neighbours[j].first, expected[j].second);
+        }
+
+        kdtree.findNeighborsWithinRadius(test_point, 2.0, neighbours, true);
+        const std::size_t within =
+            std::count_if(expected.begin(), expected.end(),
+                          [](const std::pair<double, std::size_t> &entry) -> bool { return entry.first <= 4.0; });
+        ASSERT_EQ(neighbours.size(), within);
+    }
+}
+
+TEST(KDTreeTest, metricsMatchBruteForce)
+{
+    constexpr std::size_t NUM_PTS = 10'000UL;
+    constexpr std::size_t NUM_TEST_PTS = 200UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+    constexpr std::size_t K = 5UL;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<double> dist(0.0, 10.0);
+    std::uniform_real_distribution<double> query_dist(-15.0, 25.0);
+
+    // Points in the periodic box [0, 10)^3, queries also outside of it
+    std::vector<point_t<double, NUM_DIM>> points;
+    points.reserve(NUM_PTS);
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    std::vector<point_t<double, NUM_DIM>> test_points;
+    test_points.reserve(NUM_TEST_PTS);
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        test_points.push_back({query_dist(gen), query_dist(gen), query_dist(gen)});
+    }
+
+    auto check_metric = [&](const auto &metric, double radius) -> void {
+        using metric_t = std::decay_t<decltype(metric)>;
+        KDTree<double, NUM_DIM, ArrayOfStructs, metric_t> kdtree(points, KDTreeBuildOptions(), metric);
+
+        for (const auto &test_point : test_points)
+        {
+            std::vector<double> expected;
+            for (const auto &point : points)
+            {
+                double distance = 0.0;
+                for (std::size_t axis = 0UL; axis < NUM_DIM; ++axis)
+                {
+                    distance = metric.accumulate(distance, metric.axisDistance(point[axis] - test_point[axis], axis));
+                }
+                expected.push_back(distance);
+            }
+            std::sort(expected.begin(), expected.end());
+
+            std::vector<std::pair<std::size_t, double>> neighbours;
+            kdtree.knearest(test_point, K, neighbours);
+            ASSERT_EQ(neighbours.size(), K);
+            for (std::size_t j = 0UL; j < K; ++j)
+            {
+                ASSERT_DOUBLE_EQ(neighbours[j].second, expected[j]);
+            }
+
+            kdtree.findNeighborsWithinRadius(test_point, radius, neighbours, true);
+            const auto within = std::upper_bound(expected.begin(), expected.end(), metric.reduce(radius));
+            ASSERT_EQ(neighbours.size(), static_cast<std::size_t>(std::distance(expected.begin(), within)));
+        }
+    };
+
+    check_metric(EuclideanMetric(), 1.5);
+    check_metric(ManhattanMetric(), 2.0);
+    check_metric(ChebyshevMetric(), 1.0);
+    check_metric(WeightedEuclideanMetric<NUM_DIM>({1.0, 0.1, 5.0}), 1.5);
+    check_metric(PeriodicEuclideanMetric<NUM_DIM>({10.0, 10.0, 10.0}), 1.5);
+    ASSERT_THROW(PeriodicEuclideanMetric<NUM_DIM>({10.0, 0.0, 10.0}), std::invalid_argument);
+}
+
+TEST(KDTreeTest, integerCoordinatesUseExactDistances)
+{
+    constexpr std::size_t NUM_PTS = 20'000UL;
+    constexpr std::size_t NUM_TEST_PTS = 200UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+    constexpr std::size_t K = 10UL;
+
+    static_assert(std::is_same_v<KDTree<float, NUM_DIM>::distance_t, float>);
+    static_assert(std::is_same_v<KDTree<std::int16_t, NUM_DIM>::distance_t, std::int64_t>);
+    static_assert(std::is_same_v<KDTree<std::uint8_t, NUM_DIM>::distance_t, std::int64_t>);
+
+    // Both squared distances round to the same double, 10000167000697224, although the second point is closer
+    {
+        const std::vector<point_t<std::int32_t, NUM_DIM>> points{{100000835, 0, 0}, {100000770, 114018, 0}};
+        const KDTree<std::int32_t, NUM_DIM> kdtree(points);
+        ASSERT_EQ(kdtree.nearestIndex({0, 0, 0}), 1UL);
+    }
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_int_distribution<std::int16_t> dist(-100, 100);
+
+    // Voxel coordinates on a coarse grid, so that many distances tie exactly
+    std::vector<point_t<std::int16_t, NUM_DIM>> points;
+    points.reserve(NUM_PTS);
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    KDTree<std::int16_t, NUM_DIM> kdtree(points, true);
+
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        const point_t<std::int16_t, NUM_DIM> test_point{dist(gen), dist(gen), dist(gen)};
+
+        std::vector<std::int64_t> expected;
+        for (const auto &point : points)
+        {
+            std::int64_t distance = 0;
+            for (std::size_t axis = 0UL; axis < NUM_DIM; ++axis)
+            {
+                const std::int64_t delta = static_cast<std::int64_t>(point[axis]) - test_point[axis];
+                distance += delta * delta;
+            }
+            expected.push_back(distance);
+        }
+        std::sort(expected.begin(), expected.end());
+
+        std::vector<KDTree<std::int16_t, NUM_DIM>::neighbour_t> neighbours;
+        kdtree.knearest(test_point, K, neighbours);
+        ASSERT_EQ(neighbours.size(), K);
+        for (std::size_t j = 0UL; j < K; ++j)
+        {
+            ASSERT_EQ(static_cast<std::int64_t>(neighbours[j].second), expected[j]);
+        }
+
+        // Points exactly on the search radius are included, the query point itself is not
+        kdtree.findNeighborsWithinRadius(test_point, 10.0, neighbours, true);
+        const auto first = std::upper_bound(expected.begin(), expected.end(), std::int64_t{0});
+        const auto last = std::upper_bound(expected.begin(), expected.end(), std::int64_t{100});
+        ASSERT_EQ(neighbours.size(), static_cast<std::size_t>(std::distance(first, last)));
+    }
+}
+
+TEST(KDTreeTest, extremeIntegerCoordinatesDoNotOverflow)
+{
+    constexpr std::size_t NUM_DIM = 3UL;
+
+    // Squared deltas of these coordinates overflow 64 bits
+    const std::vector<point_t<std::int32_t, NUM_DIM>> points = {{2'000'000'000, 2'000'000'000, 2'000'000'000},
+                                                                {-2'000'000'000, -2'000'000'000, -2'000'000'000},
+                                                                {0, 0, 0}};
+    KDTree<std::int32_t, NUM_DIM> kdtree(points);
+
+    const point_t<std::int32_t, NUM_DIM> query = {-2'000'000'000, -2'000'000'000, -1'999'999'999};
+    ASSERT_EQ(kdtree.nearestIndex(query), 1UL);
+
+    std::vector<KDTree<std::int32_t, NUM_DIM>::neighbour_t> neighbours;
+    kdtree.knearest(query, 3UL, neighbours);
+    ASSERT_EQ(neighbours[0].first, 1UL);
+    ASSERT_EQ(neighbours[1].first, 2UL);
+    ASSERT_EQ(neighbours[2].first, 0UL);
+    ASSERT_DOUBLE_EQ(neighbours[0].second, 1.0);
+
+    const point_t<std::int32_t, NUM_DIM> extreme = {std::numeric_limits<std::int32_t>::max(),
+                                                    std::numeric_limits<std::int32_t>::min(), 0};
+    ASSERT_EQ(kdtree.nearestIndex(extreme), 2UL);
+}
+
+TEST(KDTreeTest, rangeQueryMatchesBruteForce)
+{
+    constexpr std::size_t NUM_PTS = 20'000UL;
+    constexpr std::size_t NUM_TEST_BOXES = 200UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<double> dist(-10.0, 10.0);
+    std::uniform_real_distribution<double> extent(0.0, 8.0);
+
+    std::vector<point_t<double, NUM_DIM>> points;
+    points.reserve(NUM_PTS);
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    std::vector<KDTree<double, NUM_DIM>::box_t> boxes;
+    for (std::size_t i = 0UL; i < NUM_TEST_BOXES; ++i)
+    {
+        point_t<double, NUM_DIM> low{dist(gen), dist(gen), dist(gen)};
+        point_t<double, NUM_DIM> high;
+        for (std::size_t axis = 0UL; axis < NUM_DIM; ++axis)
+        {
+            high[axis] = low[axis] + extent(gen);
+        }
+        boxes.emplace_back(low, high);
+    }
+    // Boxes around everything, around nothing, and with a tree point exactly on the boundary
+    boxes.emplace_back(point_t<double, NUM_DIM>{-11.0, -11.0, -11.0}, point_t<double, NUM_DIM>{11.0, 11.0, 11.0});
+    boxes.emplace_back(point_t<double, NUM_DIM>{11.0, 11.0, 11.0}, point_t<double, NUM_DIM>{12.0, 12.0, 12.0});
+    boxes.emplace_back(points.front(), points.front());
+
+    KDTreeBuildOptions options;
+    options.leaf_size = 4UL;
+    KDTree<double, NUM_DIM> kdtree(points, options);
+
+    std::vector<std::vector<std::size_t>> batched_indices;
+    kdtree.rangeQuery(boxes, batched_indices);
+    std::vector<std::size_t> batched_counts;
+    kdtree.rangeCount(boxes, batched_counts);
+
+    for (std::size_t i = 0UL; i < boxes.size(); ++i)
+    {
+        const auto &[low, high] = boxes[i];
+        std::vector<std::size_t> expected;
+        for (std::size_t index = 0UL; index < NUM_PTS; ++index)
+        {
+            bool inside = true;
+            for (std::size_t axis = 0UL; axis < NUM_DIM; ++axis)
+            {
+                inside = inside && low[axis] <= points[index][axis] && points[index][axis] <= high[axis];
+            }
+            if (inside)
+            {
+                expected.push_back(index);
+            }
+        }
+
+        std::vector<std::size_t> indices;
+        kdtree.rangeQuery(low, high, indices);
+        std::sort(indices.begin(), indices.end());
+        ASSERT_EQ(expected, indices);
+
+        std::vector<point_t<double, NUM_DIM>> inside_points;
+        kdtree.rangeQuery(low, high, inside_points);
+        ASSERT_EQ(inside_points.size(), expected.size());
+
+        ASSERT_EQ(kdtree.rangeCount(low, high), expected.size());
+        ASSERT_EQ(batched_counts[i], expected.size());
+        std::sort(batched_indices[i].begin(), batched_indices[i].end());
+        ASSERT_EQ(batched_indices[i], expected);
+    }
+    ASSERT_EQ(kdtree.rangeCount(boxes[NUM_TEST_BOXES].first, boxes[NUM_TEST_BOXES].second), NUM_PTS);
+}
+
+TEST(KDTreeTest, clusteredDataMatchesBruteForce)
+{
+    constexpr std::size_t NUM_CLUSTERS = 8UL;
+    constexpr std::size_t NUM_PTS_PER_CLUSTER = 2'000UL;
+    constexpr std::size_t NUM_TEST_PTS = 300UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+    constexpr std::size_t K = 7UL;
+    constexpr double RADIUS = 0.3;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<double> dist(0.0, 100.0);
+    std::normal_distribution<double> spread(0.0, 0.5);
+
+    // Tight clusters far apart and a thin line, leaving most cells of the partition nearly empty
+    std::vector<point_t<double, NUM_DIM>> points;
+    for (std::size_t cluster = 0UL; cluster < NUM_CLUSTERS; ++cluster)
+    {
+        const point_t<double, NUM_DIM> center{dist(gen), dist(gen), dist(gen)};
+        for (std::size_t i = 0UL; i < NUM_PTS_PER_CLUSTER; ++i)
+        {
+            points.push_back({center[0] + spread(gen), center[1] + spread(gen), center[2] + spread(gen)});
+        }
+    }
+    for (std::size_t i = 0UL; i < NUM_PTS_PER_CLUSTER; ++i)
+    {
+        points.push_back({dist(gen), 50.0, 50.0 + 0.01 * spread(gen)});
+    }
+
+    std::vector<point_t<double, NUM_DIM>> test_points;
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        // Half of the queries near the data, half anywhere in the domain
+        const auto &near = points[gen() % points.size()];
+        if (i % 2UL == 0UL)
+        {
+            test_points.push_back({near[0] + spread(gen), near[1] + spread(gen), near[2] + spread(gen)});
+        }
+        else
+        {
+            test_points.push_back({dist(gen), dist(gen), dist(gen)});
+        }
+    }
+
+    for (const std::size_t leaf_size : {1UL, 16UL})
+    {
+        KDTreeBuildOptions options;
+        options.leaf_size = leaf_size;
+        KDTree<double, NUM_DIM> kdtree(points, options);
+
+        for (const auto &test_point : test_points)
+        {
+            std::vector<double> expected;
+            for (const auto &point : points)
+            {
+                double distance = 0.0;
+                for (std::size_t axis = 0UL; axis < NUM_DIM; ++axis)
+                {
+                    distance += (point[axis] - test_point[axis]) * (point[axis] - test_point[axis]);
+                }
+                expected.push_back(distance);
+            }
+            std::sort(expected.begin(), expected.end());
+
+            const auto nearest = kdtree.nearest(test_point);
+            double nearest_distance = 0.0;
+            for (std::size_t axis = 0UL; axis < NUM_DIM; ++axis)
+            {
+                nearest_distance += (nearest[axis] - test_point[axis]) * (nearest[axis] - test_point[axis]);
+            }
+            ASSERT_DOUBLE_EQ(nearest_distance, expected.front());
+
+            std::vector<std::pair<std::size_t, double>> neighbours;
+            kdtree.knearest(test_point, K, neighbours);
+            ASSERT_EQ(neighbours.size(), K);
+            for (std::size_t j = 0UL; j < K; ++j)
+            {
+                ASSERT_DOUBLE_EQ(neighbours[j].second, expected[j]);
+            }
+
+            kdtree.findNeighborsWithinRadius(test_point, RADIUS, neighbours, true);
+            const auto within = std::upper_bound(expected.begin(), expected.end(), RADIUS * RADIUS);
+            ASSERT_EQ(neighbours.size(), static_cast<std::size_t>(std::distance(expected.begin(), within)));
+        }
+    }
+}
+
+TEST(KDTreeTest, instrumentedTreeCountsQueryWork)
+{
+    constexpr std::size_t NUM_PTS = 20'000UL;
+    constexpr std::size_t NUM_TEST_PTS = 500UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+    constexpr std::size_t K = 5UL;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<double> dist(-10.0, 10.0);
+
+    std::vector<point_t<double, NUM_DIM>> points;
+    points.reserve(NUM_PTS);
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    std::vector<point_t<double, NUM_DIM>> test_points;
+    test_points.reserve(NUM_TEST_PTS);
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        test_points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    using instrumented_tree_t = KDTree<double, NUM_DIM, ArrayOfStructs, EuclideanMetric, true>;
+    KDTree<double, NUM_DIM> kdtree(points);
+    instrumented_tree_t instrumented(points);
+    ASSERT_EQ(instrumented.queryStats().queries, 0UL);
+
+    for (const auto &test_point : test_points)
+    {
+        ASSERT_EQ(instrumented.nearestIndex(test_point), kdtree.nearestIndex(test_point));
+
+        const KDTreeQueryStats stats = instrumented_tree_t::lastQueryStats();
+        ASSERT_EQ(stats.queries, 1UL);
+        ASSERT_GE(stats.leaves_scanned, 1UL);
+        ASSERT_GT(stats.nodes_visited, stats.leaves_scanned);
+        ASSERT_GT(stats.distance_evaluations, stats.leaves_scanned);
+        ASSERT_LT(stats.distance_evaluations, NUM_PTS);
+        ASSERT_LE(stats.max_stack_depth, MAX_TREE_DEPTH);
+    }
+
+    KDTreeQueryStats total = instrumented.queryStats();
+    ASSERT_EQ(total.queries, NUM_TEST_PTS);
+    ASSERT_GT(total.subtrees_pruned, 0UL);
+    ASSERT_GT(total.max_stack_depth, 0UL);
+
+    // More neighbours need more work, batched queries count once per point
+    instrumented.resetQueryStats();
+    ASSERT_EQ(instrumented.queryStats().queries, 0UL);
+    ASSERT_EQ(instrumented.queryStats().distance_evaluations, 0UL);
+
+    std::vector<std::vector<std::pair<std::size_t, double>>> batched_neighbours;
+    instrumented.knearest(test_points, K, batched_neighbours);
+    const KDTreeQueryStats knearest_total = instrumented.queryStats();
+    ASSERT_EQ(knearest_total.queries, NUM_TEST_PTS);
+    ASSERT_GT(knearest_total.distance_evaluations, total.distance_evaluations);
+
+    // Range queries count the subtrees reported as a whole as visited nodes
+    instrumented.resetQueryStats();
+    const point_t<double, NUM_DIM> low{-11.0, -11.0, -11.0};
+    const point_t<double, NUM_DIM> high{11.0, 11.0, 11.0};
+    ASSERT_EQ(instrumented.rangeCount(low, high), NUM_PTS);
+    total = instrumented_tree_t::lastQueryStats();
+    ASSERT_EQ(total.queries, 1UL);
+    ASSERT_EQ(total.nodes_visited, 1UL);
+    ASSERT_EQ(total.distance_evaluations, 0UL);
+
+    // Copies take a snapshot of the statistics
+    const instrumented_tree_t copy(instrumented);
+    ASSERT_EQ(copy.queryStats().queries, 1UL);
+}
+
+TEST(KDTreeTest, sortedBatchQueriesKeepInputOrder)
+{
+    constexpr std::size_t NUM_PTS = 20'000UL;
+    constexpr std::size_t NUM_TEST_PTS = 5'000UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+    constexpr std::size_t K = 4UL;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<double> dist(-10.0, 10.0);
+
+    std::vector<point_t<double, NUM_DIM>> points;
+    points.reserve(NUM_PTS);
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    std::vector<point_t<double, NUM_DIM>> test_points;
+    test_points.reserve(NUM_TEST_PTS);
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        test_points.push_back({dist(gen), dist(gen), dist(gen)});
+    }
+
+    KDTree<double, NUM_DIM> kdtree(points);
+    KDTreeSearchOptions sorted;
+    sorted.sort_queries = true;
+
+    std::vector<point_t<double, NUM_DIM>> expected_points;
+    std::vector<point_t<double, NUM_DIM>> sorted_points;
+    kdtree.nearest(test_points, expected_points, KDTreeSearchOptions());
+    kdtree.nearest(test_points, sorted_points, sorted);
+    ASSERT_EQ(sorted_points, expected_points);
+
+    std::vector<std::size_t> sorted_indices;
+    kdtree.nearest(test_points, sorted_indices, sorted);
+    ASSERT_EQ(sorted_indices.size(), NUM_TEST_PTS);
+    for (std::size_t i = 0UL; i < NUM_TEST_PTS; ++i)
+    {
+        ASSERT_EQ(points[sorted_indices[i]], expected_points[i]);
+    }
+
+    std::vector<std::vector<std::pair<std::size_t, double>>> expected_neighbours;
+    std::vector<std::vector<std::pair<std::size_t, double>>> sorted_neighbours;
+    kdtree.knearest(test_points, K, expected_neighbours, KDTreeSearchOptions());
+    kdtree.knearest(test_points, K, sorted_neighbours, sorted);
+    ASSERT_EQ(sorted_neighbours, expected_neighbours);
+}
+
+TEST(KDTreeTest, allNearestNeighboursMatchesBruteForce)
+{
+    constexpr std::size_t NUM_PTS = 3'000UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+    constexpr std::size_t K = 6UL;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<double> dist(0.0, 10.0);
+
+    // Some points appear twice, their duplicate is their nearest neighbour at distance 0
+    std::vector<point_t<double, NUM_DIM>> points;
+    points.reserve(NUM_PTS);
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        if (i % 10UL == 9UL)
+        {
+            points.push_back(points[i - 1UL]);
+        }
+        else
+        {
+            points.push_back({dist(gen), dist(gen), dist(gen)});
+        }
+    }
+
+    auto check_metric = [&](const auto &metric, std::size_t leaf_size) -> void {
+        using metric_t = std::decay_t<decltype(metric)>;
+        KDTreeBuildOptions options;
+        options.leaf_size = leaf_size;
+        KDTree<double, NUM_DIM, ArrayOfStructs, metric_t> kdtree(points, options, metric);
+
+        std::vector<std::vector<std::pair<std::size_t, double>>> neighbours;
+        kdtree.allNearestNeighbours(K, neighbours);
+        ASSERT_EQ(neighbours.size(), NUM_PTS);
+
+        for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+        {
+            std::vector<double> expected;
+            for (std::size_t j = 0UL; j < NUM_PTS; ++j)
+            {
+                if (j == i)
+                {
+                    continue;
+                }
+                double distance = 0.0;
+                for (std::size_t axis = 0UL; axis < NUM_DIM; ++axis)
+                {
+                    distance =
+                        metric.accumulate(distance, metric.axisDistance(points[j][axis] - points[i][axis], axis));
+                }
+                expected.push_back(distance);
+            }
+            std::sort(expected.begin(), expected.end());
+
+            ASSERT_EQ(neighbours[i].size(), K);
+            for (std::size_t j = 0UL; j < K; ++j)
+            {
+                ASSERT_NE(neighbours[i][j].first, i);
+                ASSERT_DOUBLE_EQ(neighbours[i][j].second, expected[j]);
+            }
+        }
+    };
+
+    check_metric(EuclideanMetric(), DEFAULT_LEAF_SIZE);
+    check_metric(EuclideanMetric(), 1UL);
+    check_metric(ChebyshevMetric(), 4UL);
+    check_metric(PeriodicEuclideanMetric<NUM_DIM>({10.0, 10.0, 10.0}), DEFAULT_LEAF_SIZE);
+
+    // With fewer points than neighbours asked for, every point gets all others
+    const std::vector<point_t<double, NUM_DIM>> few_points(points.begin(), points.begin() + 4);
+    KDTree<double, NUM_DIM> small_tree(few_points);
+    std::vector<std::vector<std::pair<std::size_t, double>>> neighbours;
+    small_tree.allNearestNeighbours(K, neighbours);
+    for (const auto &row : neighbours)
+    {
+        ASSERT_EQ(row.size(), few_points.size() - 1UL);
+    }
+}
+
+TEST(KDTreeTest, hintedQueriesAndCorrespondences)
+{
+    constexpr std::size_t NUM_PTS = 5'000UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+    constexpr double MAX_DISTANCE = 0.05;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<double> dist(0.0, 10.0);
+    std::normal_distribution<double> jitter(0.0, 0.03);
+
+    std::vector<point_t<double, NUM_DIM>> points;
+    std::vector<point_t<double, NUM_DIM>> moved_points;
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        points.push_back({dist(gen), dist(gen), dist(gen)});
+        moved_points.push_back({points[i][0] + jitter(gen), points[i][1] + jitter(gen), points[i][2] + jitter(gen)});
+    }
+
+    KDTree<double, NUM_DIM, ArrayOfStructs, EuclideanMetric, true> kdtree(points);
+    auto distance = [](const point_t<double, NUM_DIM> &lhs, const point_t<double, NUM_DIM> &rhs) -> double {
+        double sum = 0.0;
+        for (std::size_t axis = 0UL; axis < NUM_DIM; ++axis)
+        {
+            sum += (rhs[axis] - lhs[axis]) * (rhs[axis] - lhs[axis]);
+        }
+        return sum;
+    };
+
+    // A hint never changes the result, not even a far one or one that is not a point of the tree
+    kdtree.resetQueryStats();
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        const std::size_t plain = kdtree.nearestIndex(moved_points[i]);
+        ASSERT_EQ(kdtree.nearestIndex(moved_points[i], points[i]), plain);
+        ASSERT_EQ(kdtree.nearestIndex(moved_points[i], points[(i + 1UL) % NUM_PTS]), plain);
+        ASSERT_EQ(kdtree.nearestIndex(moved_points[i], moved_points[i]), plain);
+
+        // So does a distance hint, above, at or below the distance of the nearest neighbour
+        const double plain_distance = std::sqrt(distance(moved_points[i], points[plain]));
+        ASSERT_EQ(kdtree.nearestIndex(moved_points[i], 2.0 * plain_distance), plain);
+        ASSERT_EQ(kdtree.nearestIndex(moved_points[i], plain_distance), plain);
+        ASSERT_EQ(kdtree.nearestIndex(moved_points[i], 0.5 * plain_distance), plain);
+        ASSERT_EQ(kdtree.nearestIndex(moved_points[i], 0.0), plain);
+    }
+
+    // A good hint visits fewer nodes than the unbounded search
+    kdtree.resetQueryStats();
+    for (const auto &point : moved_points)
+    {
+        kdtree.nearestIndex(point);
+    }
+    const std::size_t plain_nodes = kdtree.queryStats().nodes_visited;
+    kdtree.resetQueryStats();
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        kdtree.nearestIndex(moved_points[i], points[i]);
+    }
+    ASSERT_LT(kdtree.queryStats().nodes_visited, plain_nodes);
+    // The margin keeps the hint above the distance to points[i] once the square root is squared again
+    kdtree.resetQueryStats();
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        kdtree.nearestIndex(moved_points[i], 1.001 * std::sqrt(distance(moved_points[i], points[i])));
+    }
+    ASSERT_LT(kdtree.queryStats().nodes_visited, plain_nodes);
+
+    for (const bool sort_queries : {false, true})
+    {
+        KDTreeSearchOptions options;
+        options.sort_queries = sort_queries;
+        std::vector<std::size_t> indices;
+        std::vector<double> distances;
+        kdtree.correspondences(moved_points, MAX_DISTANCE, indices, distances, options);
+        ASSERT_EQ(indices.size(), NUM_PTS);
+        ASSERT_EQ(distances.size(), NUM_PTS);
+
+        std::size_t unmatched = 0UL;
+        for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+        {
+            const std::size_t nearest = kdtree.nearestIndex(moved_points[i]);
+            const double nearest_distance = distance(moved_points[i], points[nearest]);
+            if (nearest_distance <= MAX_DISTANCE * MAX_DISTANCE)
+            {
+                ASSERT_NE(indices[i], KDTREE_NO_NEIGHBOUR);
+                ASSERT_DOUBLE_EQ(distances[i], nearest_distance);
+                ASSERT_DOUBLE_EQ(distance(moved_points[i], points[indices[i]]), nearest_distance);
+            }
+            else
+            {
+                ASSERT_EQ(indices[i], KDTREE_NO_NEIGHBOUR);
+                ASSERT_EQ(distances[i], std::numeric_limits<double>::infinity());
+                ++unmatched;
+            }
+        }
+        // The jitter moves some points farther than the cutoff
+        ASSERT_GT(unmatched, 0UL);
+        ASSERT_LT(unmatched, NUM_PTS);
+    }
+
+    // The cutoff is inclusive and an infinite one accepts every match
+    const std::vector<point_t<double, NUM_DIM>> queries = {{20.0, 20.0, 20.0}};
+    std::vector<std::size_t> indices;
+    std::vector<double> distances;
+    kdtree.correspondences(queries, std::numeric_limits<double>::infinity(), indices, distances);
+    ASSERT_EQ(indices[0], kdtree.nearestIndex(queries[0]));
+
+    const std::vector<point_t<int, NUM_DIM>> integer_points = {{0, 0, 0}, {10, 10, 10}};
+    const std::vector<point_t<int, NUM_DIM>> integer_queries = {{3, 4, 0}};
+    KDTree<int, NUM_DIM> integer_tree(integer_points);
+    integer_tree.correspondences(integer_queries, 5.0, indices, distances);
+    ASSERT_EQ(indices[0], 0UL);
+    ASSERT_EQ(distances[0], 25.0);
+    integer_tree.correspondences(integer_queries, 4.99, indices, distances);
+    ASSERT_EQ(indices[0], KDTREE_NO_NEIGHBOUR);
+    ASSERT_EQ(integer_tree.nearestIndex(integer_queries[0], integer_points[1]), 0UL);
+}
+
+TEST(KDTreeTest, runtimeDimensionMatchesBruteForce)
+{
+    constexpr std::size_t NUM_PTS = 2'000UL;
+    constexpr std::size_t NUM_QUERIES = 50UL;
+    constexpr std::size_t K = 5UL;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<double> dist(0.0, 10.0);
+
+    // Kernel sizes as well as padded ones, stored with one unused coordinate after every point
+    for (const std::size_t dimension : {1UL, 2UL, 3UL, 5UL, 16UL, 17UL, 100UL, 128UL})
+    {
+        const std::size_t stride = dimension + 1UL;
+        std::vector<double> data(NUM_PTS * stride);
+        for (auto &coordinate : data)
+        {
+            coordinate = dist(gen);
+        }
+        std::vector<double> queries(NUM_QUERIES * dimension);
+        for (auto &coordinate : queries)
+        {
+            coordinate = dist(gen);
+        }
+
+        RuntimeKDTree<double> kdtree(data.data(), NUM_PTS, dimension, stride);
+        ASSERT_EQ(kdtree.size(), NUM_PTS);
+        ASSERT_EQ(kdtree.dimension(), dimension);
+        ASSERT_GE(kdtree.kernelDimension(), dimension);
+
+        std::vector<std::size_t> batch_indices;
+        kdtree.nearest(queries, batch_indices);
+        std::vector<std::vector<std::pair<std::size_t, double>>> batch_neighbours;
+        kdtree.knearest(queries, K, batch_neighbours);
+        ASSERT_EQ(batch_indices.size(), NUM_QUERIES);
+
+        for (std::size_t q = 0UL; q < NUM_QUERIES; ++q)
+        {
+            const double *query = queries.data() + q * dimension;
+            std::vector<std::pair<double, std::size_t>> expected;
+            for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+            {
+                double distance = 0.0;
+                for (std::size_t axis = 0UL; axis < dimension; ++axis)
+                {
+                    const double delta = data[i * stride + axis] - query[axis];
+                    distance += delta * delta;
+                }
+                expected.emplace_back(distance, i);
+            }
+            std::sort(expected.begin(), expected.end());
+
+            ASSERT_EQ(kdtree.nearestIndex(query), expected[0].second);
+            ASSERT_EQ(batch_indices[q], expected[0].second);
+
+            std::vector<std::pair<std::size_t, double>> neighbours;
+            kdtree.knearest(query, K, neighbours);
+            ASSERT_EQ(neighbours.size(), K);
+            for (std::size_t j = 0UL; j < K; ++j)
+            {
+                ASSERT_DOUBLE_EQ(neighbours[j].second, expected[j].first);
+                ASSERT_DOUBLE_EQ(batch_neighbours[q][j].second, expected[j].first);
+            }
+
+            // Radius between the K-th and the next distance
+            const double radius = std::sqrt((expected[K - 1UL].first + expected[K].first) / 2.0);
+            kdtree.findNeighborsWithinRadius(query, radius, neighbours);
+            ASSERT_EQ(neighbours.size(), K);
+        }
+    }
+
+    const std::vector<double> coordinates(129UL * 4UL, 1.0);
+    ASSERT_THROW(RuntimeKDTree<double>(coordinates, 129UL), std::invalid_argument);
+    ASSERT_THROW(RuntimeKDTree<double>(coordinates, 0UL), std::invalid_argument);
+    ASSERT_THROW(RuntimeKDTree<double>(coordinates, 5UL), std::invalid_argument);
+    ASSERT_EQ(RuntimeKDTree<double>(coordinates, 4UL).kernelDimension(), 4UL);
+}
+
+TEST(KDTreeTest, forestFindsNearestNeighbours)
+{
+    constexpr std::size_t NUM_PTS = 5'000UL;
+    constexpr std::size_t NUM_QUERIES = 100UL;
+    constexpr std::size_t NUM_DIM = 32UL;
+    constexpr std::size_t K = 5UL;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<double> dist(0.0, 10.0);
+
+    auto random_point = [&]() -> point_t<double, NUM_DIM> {
+        point_t<double, NUM_DIM> point;
+        std::generate(point.begin(), point.end(), [&]() { return dist(gen); });
+        return point;
+    };
+    std::vector<point_t<double, NUM_DIM>> points(NUM_PTS);
+    std::generate(points.begin(), points.end(), random_point);
+    std::vector<point_t<double, NUM_DIM>> queries(NUM_QUERIES);
+    std::generate(queries.begin(), queries.end(), random_point);
+
+    KDForest<double, NUM_DIM> forest(points);
+    ASSERT_EQ(forest.size(), NUM_PTS);
+    ASSERT_EQ(forest.treeCount(), DEFAULT_FOREST_SIZE);
+
+    // Threaded and sequential builds draw the same splits
+    KDTreeBuildOptions options;
+    options.seed = 7UL;
+    KDForest<double, NUM_DIM> threaded_forest(points, 2UL, options);
+    options.threaded = false;
+    KDForest<double, NUM_DIM> sequential_forest(points, 2UL, options);
+    KDTreeSearchOptions budget;
+    budget.max_leaves = 8UL;
+
+    std::vector<std::vector<std::pair<std::size_t, double>>> batch_neighbours;
+    forest.knearest(queries, K, batch_neighbours);
+
+    for (std::size_t q = 0UL; q < NUM_QUERIES; ++q)
+    {
+        std::vector<std::pair<double, std::size_t>> expected;
+        for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+        {
+            double distance = 0.0;
+            for (std::size_t axis = 0UL; axis < NUM_DIM; ++axis)
+            {
+                distance += (points[i][axis] - queries[q][axis]) * (points[i][axis] - queries[q][axis]);
+            }
+            expected.emplace_back(distance, i);
+        }
+        std::sort(expected.begin(), expected.end());
+
+        // Without a budget the search is exact and reports every point once
+        ASSERT_EQ(forest.nearestIndex(queries[q]), expected[0].second);
+        std::vector<std::pair<std::size_t, double>> neighbours;
+        forest.knearest(queries[q], K, neighbours);
+        ASSERT_EQ(neighbours.size(), K);
+        ASSERT_EQ(batch_neighbours[q], neighbours);
+        for (std::size_t j = 0UL; j < K; ++j)
+        {
+            ASSERT_EQ(neighbours[j].first, expected[j].second);
+            ASSERT_DOUBLE_EQ(neighbours[j].second, expected[j].first);
+        }
+
+        // Within a budget the neighbours are distinct points at their reported distances
+        forest.knearest(queries[q], K, neighbours, budget);
+        ASSERT_EQ(neighbours.size(), K);
+        std::vector<std::size_t> indices;
+        for (const auto &[index, distance] : neighbours)
+        {
+            ASSERT_GE(distance, expected[0].first);
+            indices.push_back(index);
+        }
+        std::sort(indices.begin(), indices.end());
+        ASSERT_EQ(std::unique(indices.begin(), indices.end()), indices.end());
+
+        std::vector<std::pair<std::size_t, double>> sequential_neighbours;
+        threaded_forest.knearest(queries[q], K, neighbours, budget);
+        sequential_forest.knearest(queries[q], K, sequential_neighbours, budget);
+        ASSERT_EQ(neighbours, sequential_neighbours);
+    }
+
+    KDForest<double, NUM_DIM> empty_forest{std::vector<point_t<double, NUM_DIM>>()};
+    ASSERT_THROW(empty_forest.nearestIndex(queries[0]), std::logic_error);
+    // Checked before the parallel loop, where an exception would terminate
+    std::vector<std::size_t> empty_indices;
+    std::vector<std::vector<std::pair<std::size_t, double>>> empty_neighbours;
+    ASSERT_THROW(empty_forest.nearest(queries, empty_indices), std::logic_error);
+    ASSERT_THROW(empty_forest.knearest(queries, K, empty_neighbours), std::logic_error);
+    ASSERT_THROW((KDForest<double, NUM_DIM>(points, 0UL)), std::invalid_argument);
+}
+
+TEST(KDTreeTest, euclideanClustersMatchBruteForce)
+{
+    constexpr std::size_t NUM_PTS = 3'000UL;
+    constexpr std::size_t NUM_DIM = 3UL;
+    constexpr double RADIUS = 1.0;
+
+    std::random_device rd;
+    std::mt19937_64 gen(rd());
+    std::uniform_real_distribution<double> dist(0.0, 100.0);
+    std::normal_distribution<double> spread(0.0, 1.0);
+
+    // Dense blobs and sparse background points, some of them duplicates
+    std::vector<point_t<double, NUM_DIM>> centers(20UL);
+    std::generate(centers.begin(), centers.end(), [&]() -> point_t<double, NUM_DIM> {
+        return {dist(gen), dist(gen), dist(gen)};
+    });
+    std::vector<point_t<double, NUM_DIM>> points;
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        if (i % 4UL == 3UL)
+        {
+            points.push_back({dist(gen), dist(gen), dist(gen)});
+        }
+        else if (i % 50UL == 49UL)
+        {
+            points.push_back(points[i - 1UL]);
+        }
+        else
+        {
+            const auto &center = centers[i % centers.size()];
+            points.push_back({center[0] + spread(gen), center[1] + spread(gen), center[2] + spread(gen)});
+        }
+    }
+
+    std::vector<std::vector<std::size_t>> neighbours(NUM_PTS);
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        for (std::size_t j = 0UL; j < NUM_PTS; ++j)
+        {
+            double distance = 0.0;
+            for (std::size_t axis = 0UL; axis < NUM_DIM; ++axis)
+            {
+                distance += (points[i][axis] - points[j][axis]) * (points[i][axis] - points[j][axis]);
+            }
+            if (distance <= RADIUS * RADIUS)
+            {
+                neighbours[i].push_back(j);
+            }
+        }
+    }
+
+    KDTreeBuildOptions build_options;
+    build_options.leaf_size = 8UL;
+    KDTree<double, NUM_DIM> kdtree(points, build_options);
+
+    for (const std::size_t min_points : {1UL, 2UL, 5UL, 10UL})
+    {
+        // Connected components of the core points
+        std::vector<bool> core(NUM_PTS);
+        for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+        {
+            core[i] = neighbours[i].size() >= min_points;
+        }
+        std::vector<std::size_t> components(NUM_PTS, KDTREE_NOISE);
+        std::vector<std::size_t> component_sizes;
+        for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+        {
+            if (!core[i] || components[i] != KDTREE_NOISE)
+            {
+                continue;
+            }
+            std::vector<std::size_t> stack = {i};
+            components[i] = component_sizes.size();
+            component_sizes.push_back(0UL);
+            while (!stack.empty())
+            {
+                const std::size_t point = stack.back();
+                stack.pop_back();
+                ++component_sizes.back();
+                for (const std::size_t neighbour : neighbours[point])
+                {
+                    if (core[neighbour] && components[neighbour] == KDTREE_NOISE)
+                    {
+                        components[neighbour] = components[i];
+                        stack.push_back(neighbour);
+                    }
+                }
+            }
+        }
+
+        EuclideanClusterOptions options;
+        options.radius = RADIUS;
+        options.min_points = min_points;
+        const std::vector<std::size_t> labels = euclideanClusters(kdtree, options);
+        ASSERT_EQ(labels.size(), NUM_PTS);
+
+        // Labels are numbered by first occurrence, and core points share them exactly with their component
+        std::size_t next_label = 0UL;
+        std::vector<std::size_t> component_of_label;
+        for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+        {
+            if (labels[i] == next_label)
+            {
+                ++next_label;
+                component_of_label.push_back(KDTREE_NOISE);
+            }
+            ASSERT_TRUE(labels[i] < next_label || labels[i] == KDTREE_NOISE);
+            if (core[i])
+            {
+                ASSERT_NE(labels[i], KDTREE_NOISE);
+                if (component_of_label[labels[i]] == KDTREE_NOISE)
+                {
+                    component_of_label[labels[i]] = components[i];
+                }
+                ASSERT_EQ(component_of_label[labels[i]], components[i]);
+            }
+        }
+        ASSERT_EQ(next_label, component_sizes.size());
+
+        // Other points join the cluster of one of their core neighbours, if they have any
+        for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+        {
+            if (core[i])
+            {
+                continue;
+            }
+            bool core_neighbour = false;
+            bool joined_neighbour = false;
+            for (const std::size_t neighbour : neighbours[i])
+            {
+                core_neighbour = core_neighbour || core[neighbour];
+                joined_neighbour = joined_neighbour || (core[neighbour] && labels[neighbour] == labels[i]);
+            }
+            ASSERT_EQ(labels[i] != KDTREE_NOISE, core_neighbour);
+            ASSERT_EQ(joined_neighbour, core_neighbour);
+        }
+    }
+
+    // Clusters outside the size limits are noise
+    EuclideanClusterOptions options;
+    options.radius = RADIUS;
+    const std::vector<std::size_t> all_labels = euclideanClusters(kdtree, options);
+    options.min_cluster_size = 3UL;
+    options.max_cluster_size = 100UL;
+    const std::vector<std::size_t> labels = euclideanClusters(kdtree, options);
+
+    std::vector<std::size_t> all_sizes(NUM_PTS, 0UL);
+    std::vector<std::size_t> sizes(NUM_PTS, 0UL);
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        ++all_sizes[all_labels[i]];
+        if (labels[i] != KDTREE_NOISE)
+        {
+            ++sizes[labels[i]];
+        }
+    }
+    std::size_t noise = 0UL;
+    for (std::size_t i = 0UL; i < NUM_PTS; ++i)
+    {
+        const std::size_t size = all_sizes[all_labels[i]];
+        ASSERT_EQ(labels[i] == KDTREE_NOISE, size < 3UL || size > 100UL);
+        if (labels[i] == KDTREE_NOISE)
+        {
+            ++noise;
+        }
+        else
+        {
+            ASSERT_EQ(sizes[labels[i]], size);
+        }
+    }
+    ASSERT_GT(noise, 0UL);
+    ASSERT_LT(noise, NUM_PTS);
+}
+
 int main(int argc, char *argv[])
 {
     testing::InitGoogleTest(&argc, argv);